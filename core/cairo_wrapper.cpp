@@ -17,12 +17,19 @@ License along with this library; if not, see <https://www.gnu.org/licenses/>.
 
 #include "cairo_wrapper.h"
 
+#include <algorithm>
+#include <array>
 #include <avif/avif.h>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <gif_lib.h>
 #include <jpeglib.h>
+#include <unordered_map>
 #include <webp/decode.h>
 #include <webp/demux.h>
+#include <webp/encode.h>
 
 using namespace cairo_wrapper;
 
@@ -412,131 +419,867 @@ cairo_status_t cairo_wrapper::read_from_view(void* closure, unsigned char* buffe
     return CAIRO_STATUS_SUCCESS;
 }
 
-/* Copyright 2018-2025 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
- *
- * This file is part of Cairo_JPG.
- *
- * Cairo_JPG is free software: you can redistribute it and/or modify
- * it under the terms of the GNU Lesser General Public License as published by
- * the Free Software Foundation, either version 3 of the License, or
- * (at your option) any later version.
- *
- * Cairo_JPG is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
- * GNU Lesser General Public License for more details.
- *
- * You should have received a copy of the GNU General Public License
- * along with Cairo_JPG.  If not, see <https://www.gnu.org/licenses/>.
- */
+static void put_u32_be(unsigned char* p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
 
-/*! This function creates a JPEG file in memory from a Cairo image surface.
- * @param sfc Pointer to a Cairo surface. It should be an image surface of
- * either CAIRO_FORMAT_ARGB32 or CAIRO_FORMAT_RGB24. Other formats are
- * converted to CAIRO_FORMAT_RGB24 before compression.
- * Please note that this may give unexpected results because JPEG does not
- * support transparency. Thus, default background color is used to replace
- * transparent regions. The default background color is black if not specified
- * explicitly. Thus converting e.g. PDF surfaces without having any specific
- * background color set will apear with black background and not white as you
- * might expect. In such cases it is suggested to manually convert the surface
- * to RGB24 before calling this function.
- * @param data Pointer to a memory pointer. This parameter receives a pointer
- * to the memory area where the final JPEG data is found in memory. This
- * function reserves the memory properly and it has to be freed by the caller
- * with free(3).
- * @param len Pointer to a variable of type size_t which will receive the final
- * lenght of the memory buffer.
- * @param quality Compression quality, 0-100.
- * @return On success the function returns CAIRO_STATUS_SUCCESS. In case of
- * error CAIRO_STATUS_INVALID_FORMAT is returned.
- */
-cairo_status_t cairo_wrapper::cairo_surface_write_to_jpeg_mem(cairo_surface_t* sfc,
-                                                              unsigned char** data,
-                                                              size_t* len,
-                                                              int quality) {
-    struct jpeg_compress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    JSAMPROW row_pointer[1];
-    cairo_surface_t* other = NULL;
+png_writer::png_writer(cairo_write_func_t write_func, void* closure,
+                       int compression_level)
+    : m_write_func(write_func), m_closure(closure), m_status(CAIRO_STATUS_SUCCESS),
+      m_zs(), m_zbuf(64 * 1024) {
+    if (deflateInit(&m_zs, compression_level) != Z_OK) {
+        m_status = CAIRO_STATUS_NO_MEMORY;
+    }
+    m_zs.next_out = m_zbuf.data();
+    m_zs.avail_out = (uInt)m_zbuf.size();
+}
 
-    // check valid input format (must be IMAGE_SURFACE && (ARGB32 || RGB24))
-    if (cairo_surface_get_type(sfc) != CAIRO_SURFACE_TYPE_IMAGE ||
-        (cairo_image_surface_get_format(sfc) != CAIRO_FORMAT_ARGB32 &&
-         cairo_image_surface_get_format(sfc) != CAIRO_FORMAT_RGB24)) {
-        // create a similar surface with a proper format if supplied input format
-        // does not fulfill the requirements
-        double x1, y1, x2, y2;
-        other = sfc;
-        cairo_t* ctx = cairo_create(other);
-        // get extents of original surface
-        cairo_clip_extents(ctx, &x1, &y1, &x2, &y2);
-        cairo_destroy(ctx);
-
-        // create new image surface
-        sfc = cairo_surface_create_similar_image(other, CAIRO_FORMAT_RGB24, x2 - x1,
-                                                 y2 - y1);
-        if (cairo_surface_status(sfc) != CAIRO_STATUS_SUCCESS)
-            return CAIRO_STATUS_INVALID_FORMAT;
-
-        // paint original surface to new surface
-        ctx = cairo_create(sfc);
-        cairo_set_source_surface(ctx, other, 0, 0);
-        cairo_paint(ctx);
-        cairo_destroy(ctx);
-    }
-
-    // finish queued drawing operations
-    cairo_surface_flush(sfc);
+png_writer::~png_writer() { deflateEnd(&m_zs); }
 
-    // init jpeg compression structures
-    cinfo.err = jpeg_std_error(&jerr);
-    jpeg_create_compress(&cinfo);
+void png_writer::write(const unsigned char* data, size_t length) {
+    if (m_status == CAIRO_STATUS_SUCCESS && length > 0) {
+        m_status = m_write_func(m_closure, data, (unsigned int)length);
+    }
+}
+
+void png_writer::write_header(int width, int height, unsigned char color_type) {
+    static const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A,
+                                               '\n'};
+    write(signature, sizeof(signature));
+
+    unsigned char ihdr[13];
+    put_u32_be(ihdr, width);
+    put_u32_be(ihdr + 4, height);
+    ihdr[8] = 8; // bit depth
+    ihdr[9] = color_type;
+    ihdr[10] = 0; // deflate
+    ihdr[11] = 0; // adaptive filtering
+    ihdr[12] = 0; // no interlace
+    write_chunk("IHDR", ihdr, sizeof(ihdr));
+}
+
+void png_writer::write_chunk(const char* type, const unsigned char* data,
+                             size_t length) {
+    unsigned char header[8];
+    put_u32_be(header, (uint32_t)length);
+    memcpy(header + 4, type, 4);
+    write(header, sizeof(header));
+    write(data, length);
+    uLong crc = crc32(0L, reinterpret_cast<const Bytef*>(type), 4);
+    if (length > 0) {
+        crc = crc32(crc, data, (uInt)length);
+    }
+    unsigned char trailer[4];
+    put_u32_be(trailer, (uint32_t)crc);
+    write(trailer, sizeof(trailer));
+}
+
+// Compressed data collects in `m_zbuf` and is written out as one IDAT chunk whenever
+// the buffer fills up, and at the end of the stream
+cairo_status_t png_writer::deflate_buffer(const unsigned char* data, size_t length,
+                                          int flush) {
+    m_zs.next_in = const_cast<Bytef*>(data);
+    m_zs.avail_in = (uInt)length;
+    while (true) {
+        if (m_zs.avail_out == 0) {
+            write_chunk("IDAT", m_zbuf.data(), m_zbuf.size());
+            m_zs.next_out = m_zbuf.data();
+            m_zs.avail_out = (uInt)m_zbuf.size();
+        }
+        int ret = deflate(&m_zs, flush);
+        if (ret == Z_STREAM_ERROR) {
+            m_status = CAIRO_STATUS_WRITE_ERROR;
+            return m_status;
+        }
+        if (flush == Z_FINISH ? ret == Z_STREAM_END
+                              : m_zs.avail_in == 0 && m_zs.avail_out > 0) {
+            break;
+        }
+    }
+    if (flush == Z_FINISH) {
+        write_chunk("IDAT", m_zbuf.data(), m_zbuf.size() - m_zs.avail_out);
+    }
+    return m_status;
+}
+
+cairo_status_t png_writer::write_image_data(const unsigned char* data, size_t length) {
+    if (m_status != CAIRO_STATUS_SUCCESS) {
+        return m_status;
+    }
+    return deflate_buffer(data, length, Z_NO_FLUSH);
+}
+
+cairo_status_t png_writer::finish() {
+    if (m_status != CAIRO_STATUS_SUCCESS) {
+        return m_status;
+    }
+    cairo_status_t status = deflate_buffer(nullptr, 0, Z_FINISH);
+    if (status != CAIRO_STATUS_SUCCESS) {
+        return status;
+    }
+    write_chunk("IEND", nullptr, 0);
+    return m_status;
+}
+
+png_row_encoder::png_row_encoder(cairo_write_func_t write_func, void* closure,
+                                 int width, int height, cairo_format_t format,
+                                 int compression_level, bool grayscale)
+    : m_png(write_func, closure, compression_level), m_width(width),
+      m_bpp((format == CAIRO_FORMAT_ARGB32 ? 4 : 3) - (grayscale ? 2 : 0)),
+      m_level(compression_level) {
+    size_t row_size = (size_t)m_width * m_bpp;
+    m_prev_row.assign(row_size, 0);
+    m_row.resize(row_size);
+    m_filtered.resize(row_size + 1);
+    m_best.resize(row_size + 1);
+    // Gray, gray and alpha, RGB or RGBA
+    static const unsigned char color_types[] = {0, 4, 2, 6};
+    m_png.write_header(width, height, color_types[m_bpp - 1]);
+}
+
+static inline unsigned char paeth_predictor(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return (unsigned char)a;
+    }
+    return (unsigned char)(pb <= pc ? b : c);
+}
+
+// Applies PNG filter `filter` to `row`, writing the result to `out`, and returns the
+// sum of the filtered bytes taken as signed values. Gives up once the sum reaches
+// `limit`, since the filter can't win then.
+static unsigned long apply_png_filter(unsigned char filter, const unsigned char* row,
+                                      const unsigned char* prev, size_t n, size_t bpp,
+                                      unsigned char* out, unsigned long limit) {
+    unsigned long sum = 0;
+    for (size_t i = 0; i < n && sum < limit; i++) {
+        int left = i >= bpp ? row[i - bpp] : 0;
+        int up = prev[i];
+        int up_left = i >= bpp ? prev[i - bpp] : 0;
+        unsigned char v;
+        switch (filter) {
+        case 1:
+            v = (unsigned char)(row[i] - left);
+            break;
+        case 2:
+            v = (unsigned char)(row[i] - up);
+            break;
+        case 3:
+            v = (unsigned char)(row[i] - ((left + up) >> 1));
+            break;
+        case 4:
+            v = (unsigned char)(row[i] - paeth_predictor(left, up, up_left));
+            break;
+        default:
+            v = row[i];
+            break;
+        }
+        out[i] = v;
+        sum += v < 128 ? v : 256 - v;
+    }
+    return sum;
+}
+
+// Picks the filter with the smallest sum of absolute differences, like libpng does.
+// Rows that repeat the previous row or hold a single color are settled without
+// trying the filters, Up and Sub turn them into zeros. Average and Paeth cost the
+// most and are left out at low levels, and level 0 doesn't filter at all.
+void png_row_encoder::filter_row() {
+    const size_t n = m_row.size();
+    const size_t bpp = m_bpp;
+    const unsigned char* row = m_row.data();
+    const unsigned char* prev = m_prev_row.data();
+    unsigned char last_filter = m_level == 0 ? 0 : m_level <= 3 ? 2 : 4;
+    unsigned char only_filter = 0xFF;
+    if (last_filter == 0) {
+        only_filter = 0;
+    } else if (memcmp(row, prev, n) == 0) {
+        only_filter = 2;
+    } else if (memcmp(row, row + bpp, n - bpp) == 0) {
+        only_filter = 1;
+    }
+    if (only_filter != 0xFF) {
+        m_best[0] = only_filter;
+        apply_png_filter(only_filter, row, prev, n, bpp, m_best.data() + 1, ~0UL);
+        return;
+    }
+
+    unsigned long best_sum = ~0UL;
+    for (unsigned char filter = 0; filter <= last_filter; filter++) {
+        m_filtered[0] = filter;
+        unsigned long sum = apply_png_filter(filter, row, prev, n, bpp,
+                                             m_filtered.data() + 1, best_sum);
+        if (sum < best_sum) {
+            best_sum = sum;
+            m_best.swap(m_filtered);
+        }
+    }
+}
+
+// Multipliers that replace the division in `(c * 255 + a / 2) / a` by a multiply and
+// a shift, exact for every premultiplied 8-bit `c` and `a`
+static const std::array<uint64_t, 256> unpremultiply_table = []() {
+    std::array<uint64_t, 256> table{};
+    for (uint64_t a = 1; a < 256; a++) {
+        table[a] = ((uint64_t(1) << 32) + a - 1) / a;
+    }
+    return table;
+}();
+
+static inline uint8_t unpremultiply(uint32_t c, uint32_t a) {
+    return (uint8_t)(((c * 255 + a / 2) * unpremultiply_table[a]) >> 32);
+}
+
+static inline uint32_t unpremultiply_argb(uint32_t p) {
+    uint32_t a = p >> 24;
+    if (a == 0xFF) {
+        return p;
+    }
+    if (a == 0) {
+        return 0;
+    }
+    return a << 24 | (uint32_t)unpremultiply((p >> 16) & 0xFF, a) << 16 |
+           (uint32_t)unpremultiply((p >> 8) & 0xFF, a) << 8 |
+           unpremultiply(p & 0xFF, a);
+}
+
+// BT.601 luma of a pixel in 8-bit fixed point, the weights JPEG uses. Premultiplied
+// channels give the premultiplied luma.
+static inline uint8_t luminance(uint32_t p) {
+    return (uint8_t)((((p >> 16) & 0xFF) * 77 + ((p >> 8) & 0xFF) * 150 +
+                      (p & 0xFF) * 29 + 128) >>
+                     8);
+}
+
+// Converts a row of native endian premultiplied ARGB pixels to the RGBA, RGB, gray
+// and alpha or gray bytes of PNG into `m_row`, with the same rounding as cairo's own
+// PNG writer
+void png_row_encoder::convert_row(const uint32_t* pixels) {
+    unsigned char* out = m_row.data();
+    if (m_bpp == 1) {
+        for (int x = 0; x < m_width; x++) {
+            out[x] = luminance(pixels[x]);
+        }
+        return;
+    }
+    if (m_bpp == 2) {
+        for (int x = 0; x < m_width; x++) {
+            uint32_t p = pixels[x];
+            uint32_t a = p >> 24;
+            uint8_t y = luminance(p);
+            out[2 * x] = a == 0 ? 0 : a == 0xFF ? y : unpremultiply(y, a);
+            out[2 * x + 1] = (uint8_t)a;
+        }
+        return;
+    }
+    if (m_bpp == 3) {
+        for (int x = 0; x < m_width; x++) {
+            uint32_t p = pixels[x];
+            out[3 * x] = (uint8_t)(p >> 16);
+            out[3 * x + 1] = (uint8_t)(p >> 8);
+            out[3 * x + 2] = (uint8_t)p;
+        }
+        return;
+    }
+    // Mostly opaque content, this loop and the swizzle below vectorize
+    uint32_t alpha_and = 0xFFFFFFFF;
+    for (int x = 0; x < m_width; x++) {
+        alpha_and &= pixels[x];
+    }
+    if ((alpha_and >> 24) == 0xFF) {
+        for (int x = 0; x < m_width; x++) {
+            uint32_t p = pixels[x];
+            out[4 * x] = (uint8_t)(p >> 16);
+            out[4 * x + 1] = (uint8_t)(p >> 8);
+            out[4 * x + 2] = (uint8_t)p;
+            out[4 * x + 3] = 0xFF;
+        }
+        return;
+    }
+    for (int x = 0; x < m_width; x++) {
+        uint32_t p = pixels[x];
+        uint32_t a = p >> 24;
+        uint8_t r = (uint8_t)(p >> 16), g = (uint8_t)(p >> 8), b = (uint8_t)p;
+        if (a == 0) {
+            r = g = b = 0;
+        } else if (a != 0xFF) {
+            r = unpremultiply(r, a);
+            g = unpremultiply(g, a);
+            b = unpremultiply(b, a);
+        }
+        out[4 * x] = r;
+        out[4 * x + 1] = g;
+        out[4 * x + 2] = b;
+        out[4 * x + 3] = (uint8_t)a;
+    }
+}
+
+cairo_status_t png_row_encoder::write_rows(const unsigned char* rows, int stride,
+                                           int count) {
+    for (int y = 0; y < count && m_png.status() == CAIRO_STATUS_SUCCESS; y++) {
+        convert_row(reinterpret_cast<const uint32_t*>(rows + (size_t)y * stride));
+        filter_row();
+        m_png.write_image_data(m_best.data(), m_best.size());
+        m_prev_row.swap(m_row);
+    }
+    return m_png.status();
+}
+
+cairo_status_t png_row_encoder::finish() { return m_png.finish(); }
+
+// Compressor state together with a destination manager that hands every filled
+// output buffer to the write function, instead of collecting the whole file in
+// memory like `jpeg_mem_dest`
+struct jpeg_row_encoder::jpeg_state {
+    jpeg_compress_struct cinfo;
+    jpeg_error_mgr jerr;
+    jpeg_destination_mgr dest;
+    cairo_write_func_t write_func;
+    void* closure;
+    cairo_status_t status = CAIRO_STATUS_SUCCESS;
+    unsigned char buffer[16 * 1024];
+
+    void write(const unsigned char* data, size_t length) {
+        if (status == CAIRO_STATUS_SUCCESS && length > 0) {
+            status = write_func(closure, data, (unsigned int)length);
+        }
+    }
+
+    static void init_destination(j_compress_ptr cinfo) {
+        auto* state = static_cast<jpeg_state*>(cinfo->client_data);
+        state->dest.next_output_byte = state->buffer;
+        state->dest.free_in_buffer = sizeof(state->buffer);
+    }
+
+    // Called when the buffer is full, regardless of `free_in_buffer`
+    static boolean empty_output_buffer(j_compress_ptr cinfo) {
+        auto* state = static_cast<jpeg_state*>(cinfo->client_data);
+        state->write(state->buffer, sizeof(state->buffer));
+        init_destination(cinfo);
+        return TRUE;
+    }
 
-    // set compression parameters
-    unsigned long jpeg_len = *len;
-    jpeg_mem_dest(&cinfo, data, &jpeg_len);
-    cinfo.image_width = cairo_image_surface_get_width(sfc);
-    cinfo.image_height = cairo_image_surface_get_height(sfc);
+    static void term_destination(j_compress_ptr cinfo) {
+        auto* state = static_cast<jpeg_state*>(cinfo->client_data);
+        state->write(state->buffer, sizeof(state->buffer) - state->dest.free_in_buffer);
+    }
+};
+
+jpeg_row_encoder::jpeg_row_encoder(cairo_write_func_t write_func, void* closure,
+                                   int width, int height, cairo_format_t format,
+                                   const jpeg_options& options)
+    : m_state(new jpeg_state) {
+    m_state->write_func = write_func;
+    m_state->closure = closure;
+    m_state->dest.init_destination = jpeg_state::init_destination;
+    m_state->dest.empty_output_buffer = jpeg_state::empty_output_buffer;
+    m_state->dest.term_destination = jpeg_state::term_destination;
+
+    jpeg_compress_struct& cinfo = m_state->cinfo;
+    cinfo.err = jpeg_std_error(&m_state->jerr);
+    jpeg_create_compress(&cinfo);
+    cinfo.client_data = m_state;
+    cinfo.dest = &m_state->dest;
+    cinfo.image_width = width;
+    cinfo.image_height = height;
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-    // cinfo.in_color_space = JCS_EXT_BGRX;
-    cinfo.in_color_space = cairo_image_surface_get_format(sfc) == CAIRO_FORMAT_ARGB32
-                               ? JCS_EXT_BGRA
-                               : JCS_EXT_BGRX;
+    cinfo.in_color_space = format == CAIRO_FORMAT_ARGB32 ? JCS_EXT_BGRA : JCS_EXT_BGRX;
 #else
-    // cinfo.in_color_space = JCS_EXT_XRGB;
-    cinfo.in_color_space = cairo_image_surface_get_format(sfc) == CAIRO_FORMAT_ARGB32
-                               ? JCS_EXT_ARGB
-                               : JCS_EXT_XRGB;
+    cinfo.in_color_space = format == CAIRO_FORMAT_ARGB32 ? JCS_EXT_ARGB : JCS_EXT_XRGB;
 #endif
     cinfo.input_components = 4;
     jpeg_set_defaults(&cinfo);
-    jpeg_set_quality(&cinfo, quality, TRUE);
-
-    // start compressor
+    jpeg_set_quality(&cinfo, options.quality, TRUE);
+    if (options.grayscale) {
+        // libjpeg converts the pixels to luma on the fly, with 1x1 sampling
+        jpeg_set_colorspace(&cinfo, JCS_GRAYSCALE);
+    } else {
+        // Luma sampling factors relative to the chroma components, which stay at 1x1
+        cinfo.comp_info[0].h_samp_factor = options.subsampling == 444 ? 1 : 2;
+        cinfo.comp_info[0].v_samp_factor = options.subsampling == 420 ? 2 : 1;
+    }
+    cinfo.dct_method = options.fast_dct ? JDCT_IFAST : JDCT_ISLOW;
+    cinfo.optimize_coding = options.optimize_coding;
+    cinfo.restart_in_rows = options.restart_rows;
+    if (options.progressive) {
+        jpeg_simple_progression(&cinfo);
+    }
     jpeg_start_compress(&cinfo, TRUE);
+}
 
-    unsigned char* pixels = cairo_image_surface_get_data(sfc);
+jpeg_row_encoder::~jpeg_row_encoder() {
+    jpeg_destroy_compress(&m_state->cinfo);
+    delete m_state;
+}
+
+cairo_status_t jpeg_row_encoder::write_rows(const unsigned char* rows, int stride,
+                                            int count) {
+    for (int y = 0; y < count; y++) {
+        JSAMPROW row_pointer[1] = {
+            const_cast<unsigned char*>(rows + (size_t)y * stride)};
+        (void)jpeg_write_scanlines(&m_state->cinfo, row_pointer, 1);
+    }
+    return m_state->status;
+}
+
+cairo_status_t jpeg_row_encoder::finish() {
+    jpeg_finish_compress(&m_state->cinfo);
+    return m_state->status;
+}
+
+/*! Compresses an ARGB32 or RGB24 image surface to PNG with zlib level `level`,
+ * like `cairo_surface_write_to_png_stream` which always uses the default level.
+ * With `grayscale` an 8-bit gray PNG is written instead.
+ */
+cairo_status_t cairo_wrapper::cairo_surface_write_to_png_stream_level(
+    cairo_surface_t* sfc, cairo_write_func_t write_func, void* closure, int level,
+    bool grayscale) {
+    cairo_format_t format = cairo_image_surface_get_format(sfc);
+    if (cairo_surface_get_type(sfc) != CAIRO_SURFACE_TYPE_IMAGE ||
+        (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)) {
+        return CAIRO_STATUS_INVALID_FORMAT;
+    }
+    cairo_surface_flush(sfc);
+    int height = cairo_image_surface_get_height(sfc);
+    png_row_encoder encoder(write_func, closure, cairo_image_surface_get_width(sfc),
+                            height, format, level, grayscale);
+    cairo_status_t status =
+        encoder.write_rows(cairo_image_surface_get_data(sfc),
+                           cairo_image_surface_get_stride(sfc), height);
+    if (status != CAIRO_STATUS_SUCCESS) {
+        return status;
+    }
+    return encoder.finish();
+}
+
+// Collects the distinct pixels of an image as a palette of up to 256 premultiplied
+// colors, with the palette index of every pixel. Returns false if there are more.
+static bool exact_palette(const unsigned char* data, int stride, int width,
+                          int height, uint32_t alpha_mask,
+                          std::vector<uint32_t>& palette,
+                          std::vector<uint8_t>& indices) {
+    std::unordered_map<uint32_t, uint8_t> lookup;
+    uint32_t last = 0;
+    uint8_t last_index = 0;
+    bool have_last = false;
+    for (int y = 0; y < height; y++) {
+        const auto* row = reinterpret_cast<const uint32_t*>(data + (size_t)y * stride);
+        uint8_t* out = indices.data() + (size_t)y * width;
+        for (int x = 0; x < width; x++) {
+            uint32_t p = row[x] | alpha_mask;
+            // Runs of one color are the common case in rendered pages
+            if (!have_last || p != last) {
+                auto it = lookup.find(p);
+                if (it == lookup.end()) {
+                    if (palette.size() == 256) {
+                        return false;
+                    }
+                    it = lookup.emplace(p, (uint8_t)palette.size()).first;
+                    palette.push_back(p);
+                }
+                last = p;
+                last_index = it->second;
+                have_last = true;
+            }
+            out[x] = last_index;
+        }
+    }
+    return true;
+}
+
+// Median cut works on colors reduced to this many bits per channel
+static constexpr int palette_channel_bits = 5;
+static constexpr uint32_t palette_channel_max = (1u << palette_channel_bits) - 1;
+
+// Reduced color of a premultiplied pixel, alpha in the highest bits
+static inline uint32_t palette_key(uint32_t p) {
+    uint32_t c = unpremultiply_argb(p);
+    constexpr int drop = 8 - palette_channel_bits;
+    uint32_t key = 0;
+    for (int channel = 3; channel >= 0; channel--) {
+        key = key << palette_channel_bits |
+              ((c >> (8 * channel + drop)) & palette_channel_max);
+    }
+    return key;
+}
+
+static inline uint32_t palette_key_channel(uint32_t key, int channel) {
+    return (key >> (palette_channel_bits * channel)) & palette_channel_max;
+}
+
+// Builds a palette of up to 256 unpremultiplied colors with median cut over the
+// histogram of reduced colors, with the palette index of every pixel
+static void median_cut_palette(const unsigned char* data, int stride, int width,
+                               int height, uint32_t alpha_mask,
+                               std::vector<uint32_t>& palette,
+                               std::vector<uint8_t>& indices) {
+    std::vector<uint32_t> histogram(size_t(1) << (4 * palette_channel_bits));
+    for (int y = 0; y < height; y++) {
+        const auto* row = reinterpret_cast<const uint32_t*>(data + (size_t)y * stride);
+        for (int x = 0; x < width; x++) {
+            histogram[palette_key(row[x] | alpha_mask)]++;
+        }
+    }
+    struct entry {
+        uint32_t key;
+        uint32_t count;
+    };
+    std::vector<entry> entries;
+    for (uint32_t key = 0; key < histogram.size(); key++) {
+        if (histogram[key] != 0) {
+            entries.push_back({key, histogram[key]});
+        }
+    }
+
+    // A box is a range of `entries`, split along the channel with the widest spread
+    struct box {
+        size_t begin;
+        size_t end;
+        int channel;
+        uint32_t spread;
+    };
+    auto make_box = [&](size_t begin, size_t end) {
+        box b{begin, end, 0, 0};
+        for (int channel = 0; channel < 4; channel++) {
+            uint32_t lo = palette_channel_max, hi = 0;
+            for (size_t i = begin; i < end; i++) {
+                uint32_t v = palette_key_channel(entries[i].key, channel);
+                lo = std::min(lo, v);
+                hi = std::max(hi, v);
+            }
+            if (hi >= lo && hi - lo > b.spread) {
+                b.channel = channel;
+                b.spread = hi - lo;
+            }
+        }
+        return b;
+    };
+    std::vector<box> boxes{make_box(0, entries.size())};
+    while (boxes.size() < 256) {
+        size_t widest = boxes.size();
+        for (size_t i = 0; i < boxes.size(); i++) {
+            if (boxes[i].spread > 0 &&
+                (widest == boxes.size() || boxes[i].spread > boxes[widest].spread)) {
+                widest = i;
+            }
+        }
+        if (widest == boxes.size()) {
+            break;
+        }
+        box b = boxes[widest];
+        std::sort(entries.begin() + b.begin, entries.begin() + b.end,
+                  [&](const entry& l, const entry& r) {
+                      return palette_key_channel(l.key, b.channel) <
+                             palette_key_channel(r.key, b.channel);
+                  });
+        // Split at the pixel weighted median, leaving at least one entry on each side
+        uint64_t total = 0, below = 0;
+        for (size_t i = b.begin; i < b.end; i++) {
+            total += entries[i].count;
+        }
+        size_t split = b.begin + 1;
+        for (size_t i = b.begin; i + 1 < b.end; i++) {
+            below += entries[i].count;
+            split = i + 1;
+            if (below * 2 >= total) {
+                break;
+            }
+        }
+        boxes[widest] = make_box(b.begin, split);
+        boxes.push_back(make_box(split, b.end));
+    }
+
+    // Each box becomes the pixel weighted mean of its colors, the histogram is
+    // reused to map reduced colors to their box
+    for (const box& b : boxes) {
+        uint64_t sums[4] = {0, 0, 0, 0}, total = 0;
+        for (size_t i = b.begin; i < b.end; i++) {
+            for (int channel = 0; channel < 4; channel++) {
+                uint32_t v = palette_key_channel(entries[i].key, channel);
+                // Scale back to 8 bits
+                v = v * 255 / palette_channel_max;
+                sums[channel] += (uint64_t)v * entries[i].count;
+            }
+            total += entries[i].count;
+            histogram[entries[i].key] = (uint32_t)palette.size();
+        }
+        uint32_t color = 0;
+        for (int channel = 3; channel >= 0; channel--) {
+            color = color << 8 | (uint32_t)((sums[channel] + total / 2) / total);
+        }
+        palette.push_back(color);
+    }
+    for (int y = 0; y < height; y++) {
+        const auto* row = reinterpret_cast<const uint32_t*>(data + (size_t)y * stride);
+        uint8_t* out = indices.data() + (size_t)y * width;
+        for (int x = 0; x < width; x++) {
+            out[x] = (uint8_t)histogram[palette_key(row[x] | alpha_mask)];
+        }
+    }
+}
+
+/*! Compresses an ARGB32 or RGB24 image surface to an 8-bit palette PNG with zlib
+ * level `level`. Images with up to 256 colors are stored exactly, others are
+ * reduced to 256 colors with median cut.
+ */
+cairo_status_t cairo_wrapper::cairo_surface_write_to_png_palette_stream(
+    cairo_surface_t* sfc, cairo_write_func_t write_func, void* closure, int level) {
+    cairo_format_t format = cairo_image_surface_get_format(sfc);
+    if (cairo_surface_get_type(sfc) != CAIRO_SURFACE_TYPE_IMAGE ||
+        (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)) {
+        return CAIRO_STATUS_INVALID_FORMAT;
+    }
+    cairo_surface_flush(sfc);
+    int width = cairo_image_surface_get_width(sfc);
+    int height = cairo_image_surface_get_height(sfc);
+    const unsigned char* data = cairo_image_surface_get_data(sfc);
     int stride = cairo_image_surface_get_stride(sfc);
+    // The unused byte of RGB24 pixels is undefined
+    uint32_t alpha_mask = format == CAIRO_FORMAT_RGB24 ? 0xFF000000 : 0;
+
+    std::vector<uint32_t> palette;
+    std::vector<uint8_t> indices((size_t)width * height);
+    if (exact_palette(data, stride, width, height, alpha_mask, palette, indices)) {
+        for (uint32_t& color : palette) {
+            color = unpremultiply_argb(color);
+        }
+    } else {
+        palette.clear();
+        median_cut_palette(data, stride, width, height, alpha_mask, palette, indices);
+    }
 
-    // loop over all lines and compress
-    while (cinfo.next_scanline < cinfo.image_height) {
-        row_pointer[0] = pixels + (cinfo.next_scanline * stride);
-        (void)jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    png_writer png(write_func, closure, level);
+    png.write_header(width, height, 3); // palette
+    std::vector<unsigned char> plte, trns;
+    bool translucent = false;
+    for (uint32_t color : palette) {
+        plte.push_back((unsigned char)(color >> 16));
+        plte.push_back((unsigned char)(color >> 8));
+        plte.push_back((unsigned char)color);
+        trns.push_back((unsigned char)(color >> 24));
+        translucent = translucent || (color >> 24) != 0xFF;
     }
+    png.write_chunk("PLTE", plte.data(), plte.size());
+    if (translucent) {
+        png.write_chunk("tRNS", trns.data(), trns.size());
+    }
+    // Filters don't help with palette indices
+    std::vector<unsigned char> row((size_t)width + 1, 0);
+    for (int y = 0; y < height && png.status() == CAIRO_STATUS_SUCCESS; y++) {
+        memcpy(row.data() + 1, indices.data() + (size_t)y * width, width);
+        png.write_image_data(row.data(), row.size());
+    }
+    return png.finish();
+}
 
-    // finalize and close everything
-    jpeg_finish_compress(&cinfo);
-    jpeg_destroy_compress(&cinfo);
-    *len = jpeg_len;
+/*! Compresses an ARGB32 or RGB24 image surface to JPEG and passes the file to
+ * `write_func` in pieces.
+ */
+cairo_status_t cairo_wrapper::cairo_surface_write_to_jpeg_stream(
+    cairo_surface_t* sfc, cairo_write_func_t write_func, void* closure,
+    const jpeg_options& options) {
+    cairo_format_t format = cairo_image_surface_get_format(sfc);
+    if (cairo_surface_get_type(sfc) != CAIRO_SURFACE_TYPE_IMAGE ||
+        (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)) {
+        return CAIRO_STATUS_INVALID_FORMAT;
+    }
+    cairo_surface_flush(sfc);
+    int height = cairo_image_surface_get_height(sfc);
+    jpeg_row_encoder encoder(write_func, closure, cairo_image_surface_get_width(sfc),
+                             height, format, options);
+    cairo_status_t status =
+        encoder.write_rows(cairo_image_surface_get_data(sfc),
+                           cairo_image_surface_get_stride(sfc), height);
+    if (status != CAIRO_STATUS_SUCCESS) {
+        return status;
+    }
+    return encoder.finish();
+}
 
-    // destroy temporary image surface (if available)
-    if (other != NULL)
-        cairo_surface_destroy(sfc);
+struct webp_writer_state {
+    cairo_write_func_t write_func;
+    void* closure;
+    cairo_status_t status;
+};
+
+static int webp_write(const uint8_t* data, size_t data_size,
+                      const WebPPicture* picture) {
+    auto* state = static_cast<webp_writer_state*>(picture->custom_ptr);
+    if (data_size > 0) {
+        state->status =
+            state->write_func(state->closure, data, (unsigned int)data_size);
+    }
+    return state->status == CAIRO_STATUS_SUCCESS;
+}
 
+/*! Compresses an ARGB32 or RGB24 image surface to WebP, lossy with `quality` 0-100
+ * or lossless with `quality` as the compression effort. `method` trades speed (0)
+ * for size (6). The pixels are unpremultiplied straight into the WebP picture and
+ * the encoded file is passed to `write_func` as libwebp produces it.
+ */
+cairo_status_t cairo_wrapper::cairo_surface_write_to_webp_stream(
+    cairo_surface_t* sfc, cairo_write_func_t write_func, void* closure, int quality,
+    bool lossless, int method) {
+    cairo_format_t format = cairo_image_surface_get_format(sfc);
+    if (cairo_surface_get_type(sfc) != CAIRO_SURFACE_TYPE_IMAGE ||
+        (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)) {
+        return CAIRO_STATUS_INVALID_FORMAT;
+    }
+    int width = cairo_image_surface_get_width(sfc);
+    int height = cairo_image_surface_get_height(sfc);
+    if (width > WEBP_MAX_DIMENSION || height > WEBP_MAX_DIMENSION) {
+        return CAIRO_STATUS_INVALID_SIZE;
+    }
+
+    WebPConfig config;
+    if (!WebPConfigInit(&config)) {
+        return CAIRO_STATUS_NO_MEMORY;
+    }
+    config.lossless = lossless;
+    config.quality = (float)quality;
+    config.method = method;
+    if (!WebPValidateConfig(&config)) {
+        return CAIRO_STATUS_INVALID_FORMAT;
+    }
+
+    WebPPicture picture;
+    if (!WebPPictureInit(&picture)) {
+        return CAIRO_STATUS_NO_MEMORY;
+    }
+    picture.use_argb = 1;
+    picture.width = width;
+    picture.height = height;
+    if (!WebPPictureAlloc(&picture)) {
+        return CAIRO_STATUS_NO_MEMORY;
+    }
+    // Both use native endian ARGB words, WebP's without premultiplied alpha
+    cairo_surface_flush(sfc);
+    const unsigned char* data = cairo_image_surface_get_data(sfc);
+    int stride = cairo_image_surface_get_stride(sfc);
+    for (int y = 0; y < height; y++) {
+        const auto* src = reinterpret_cast<const uint32_t*>(data + (size_t)y * stride);
+        uint32_t* dst = picture.argb + (size_t)y * picture.argb_stride;
+        for (int x = 0; x < width; x++) {
+            dst[x] = format == CAIRO_FORMAT_RGB24 ? src[x] | 0xFF000000
+                                                  : unpremultiply_argb(src[x]);
+        }
+    }
+
+    webp_writer_state state{write_func, closure, CAIRO_STATUS_SUCCESS};
+    picture.writer = webp_write;
+    picture.custom_ptr = &state;
+    bool encoded = WebPEncode(&config, &picture);
+    WebPEncodingError error = picture.error_code;
+    WebPPictureFree(&picture);
+    if (state.status != CAIRO_STATUS_SUCCESS) {
+        return state.status;
+    }
+    if (!encoded) {
+        return error == VP8_ENC_ERROR_OUT_OF_MEMORY ? CAIRO_STATUS_NO_MEMORY
+                                                    : CAIRO_STATUS_WRITE_ERROR;
+    }
     return CAIRO_STATUS_SUCCESS;
 }
 
+/*! Compresses an ARGB32 or RGB24 image surface to AVIF with full resolution chroma.
+ * `quality` is 0-100, `speed` trades size (0) for speed (10) and `threads` is the
+ * number of encoder threads. libavif converts the surface rows to YUV in place of a
+ * separate RGBA copy, and drops the alpha plane when every pixel is opaque.
+ */
+cairo_status_t cairo_wrapper::cairo_surface_write_to_avif_stream(
+    cairo_surface_t* sfc, cairo_write_func_t write_func, void* closure, int quality,
+    int speed, int threads) {
+    cairo_format_t format = cairo_image_surface_get_format(sfc);
+    if (cairo_surface_get_type(sfc) != CAIRO_SURFACE_TYPE_IMAGE ||
+        (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24)) {
+        return CAIRO_STATUS_INVALID_FORMAT;
+    }
+    cairo_surface_flush(sfc);
+    int width = cairo_image_surface_get_width(sfc);
+    int height = cairo_image_surface_get_height(sfc);
+    uint8_t* pixels = cairo_image_surface_get_data(sfc);
+    int stride = cairo_image_surface_get_stride(sfc);
+
+    bool opaque = format == CAIRO_FORMAT_RGB24;
+    if (!opaque) {
+        uint32_t alpha_and = 0xFFFFFFFF;
+        for (int y = 0; y < height; y++) {
+            const auto* row =
+                reinterpret_cast<const uint32_t*>(pixels + (size_t)y * stride);
+            for (int x = 0; x < width; x++) {
+                alpha_and &= row[x];
+            }
+        }
+        opaque = (alpha_and >> 24) == 0xFF;
+    }
+
+    avifImage* image = avifImageCreate(width, height, 8, AVIF_PIXEL_FORMAT_YUV444);
+    if (image == nullptr) {
+        return CAIRO_STATUS_NO_MEMORY;
+    }
+    avifRGBImage rgb;
+    avifRGBImageSetDefaults(&rgb, image);
+    rgb.depth = 8;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    rgb.format = AVIF_RGB_FORMAT_BGRA;
+#else
+    rgb.format = AVIF_RGB_FORMAT_ARGB;
+#endif
+    rgb.ignoreAlpha = opaque;
+    rgb.alphaPremultiplied = AVIF_TRUE;
+    rgb.rowBytes = stride;
+    rgb.pixels = pixels;
+    if (avifImageRGBToYUV(image, &rgb) != AVIF_RESULT_OK) {
+        avifImageDestroy(image);
+        return CAIRO_STATUS_NO_MEMORY;
+    }
+
+    avifEncoder* encoder = avifEncoderCreate();
+    if (encoder == nullptr) {
+        avifImageDestroy(image);
+        return CAIRO_STATUS_NO_MEMORY;
+    }
+    encoder->quality = quality;
+    encoder->qualityAlpha = quality;
+    encoder->speed = speed;
+    encoder->maxThreads = threads;
+    avifRWData output = AVIF_DATA_EMPTY;
+    avifResult result = avifEncoderWrite(encoder, image, &output);
+    avifEncoderDestroy(encoder);
+    avifImageDestroy(image);
+
+    cairo_status_t status = CAIRO_STATUS_WRITE_ERROR;
+    if (result == AVIF_RESULT_OK) {
+        status = write_func(closure, output.data, (unsigned int)output.size);
+    } else if (result == AVIF_RESULT_OUT_OF_MEMORY) {
+        status = CAIRO_STATUS_NO_MEMORY;
+    }
+    avifRWDataFree(&output);
+    return status;
+}
+
+/* Copyright 2018-2025 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of Cairo_JPG.
+ *
+ * Cairo_JPG is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Cairo_JPG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Cairo_JPG.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
 /*! This function decompresses a JPEG image from a memory buffer and creates a
  * Cairo image surface.
  * @param data Pointer to JPEG data (i.e. the full contents of a JPEG file read
@@ -22,6 +22,7 @@ License along with this library; if not, see <https://www.gnu.org/licenses/>.
 #include <litehtml.h>
 #include <pango/pango-font.h>
 #include <vector>
+#include <zlib.h>
 
 #include <Python.h>
 
@@ -174,13 +175,128 @@ struct BufferView {
     unsigned int offset;
 };
 
+// Encoder that is fed the rows of an ARGB32 or RGB24 image surface from top to
+// bottom, possibly while the rows below are still being drawn. The encoded file is
+// passed to `write_func` piece by piece, like `cairo_surface_write_to_png_stream`
+// does.
+class row_encoder {
+  public:
+    virtual ~row_encoder() = default;
+    virtual cairo_status_t write_rows(const unsigned char* rows, int stride,
+                                      int count) = 0;
+    virtual cairo_status_t finish() = 0;
+};
+
+// Writes a PNG file chunk by chunk to a cairo write function, deflating the image
+// data into IDAT chunks as it comes. The first failed write sticks as the status.
+class png_writer {
+  public:
+    png_writer(cairo_write_func_t write_func, void* closure, int compression_level);
+    ~png_writer();
+    png_writer(const png_writer&) = delete;
+    png_writer& operator=(const png_writer&) = delete;
+
+    // Writes the signature and IHDR chunk, `color_type` as in the PNG specification
+    void write_header(int width, int height, unsigned char color_type);
+    void write_chunk(const char* type, const unsigned char* data, size_t length);
+    // Compresses filtered scanlines
+    cairo_status_t write_image_data(const unsigned char* data, size_t length);
+    // Flushes the image data and writes IEND
+    cairo_status_t finish();
+    cairo_status_t status() const { return m_status; }
+
+  private:
+    cairo_write_func_t m_write_func;
+    void* m_closure;
+    cairo_status_t m_status;
+    z_stream m_zs;
+    std::vector<unsigned char> m_zbuf;
+
+    void write(const unsigned char* data, size_t length);
+    cairo_status_t deflate_buffer(const unsigned char* data, size_t length,
+                                  int flush);
+};
+
+class png_row_encoder : public row_encoder {
+  public:
+    // `compression_level` is the zlib level, 0 (store) to 9 (smallest). With
+    // `grayscale` the pixels are written as their luminance, 1 byte each plus alpha.
+    png_row_encoder(cairo_write_func_t write_func, void* closure, int width,
+                    int height, cairo_format_t format, int compression_level,
+                    bool grayscale);
+    cairo_status_t write_rows(const unsigned char* rows, int stride,
+                              int count) override;
+    cairo_status_t finish() override;
+
+  private:
+    png_writer m_png;
+    int m_width;
+    int m_bpp;
+    int m_level;
+    std::vector<unsigned char> m_prev_row;
+    std::vector<unsigned char> m_row;
+    std::vector<unsigned char> m_filtered;
+    std::vector<unsigned char> m_best;
+
+    void convert_row(const uint32_t* pixels);
+    void filter_row();
+};
+
+// libjpeg compression settings
+struct jpeg_options {
+    // 0-100
+    int quality = 90;
+    // Chroma subsampling, 444, 422 or 420
+    int subsampling = 420;
+    // Faster integer DCT, slightly less accurate
+    bool fast_dct = false;
+    // Optimal Huffman tables, smaller but needs an extra pass
+    bool optimize_coding = false;
+    bool progressive = false;
+    // Restart marker every this many MCU rows, 0 for none
+    int restart_rows = 0;
+    // Single luminance component, subsampling doesn't apply
+    bool grayscale = false;
+};
+
+class jpeg_row_encoder : public row_encoder {
+  public:
+    jpeg_row_encoder(cairo_write_func_t write_func, void* closure, int width,
+                     int height, cairo_format_t format, const jpeg_options& options);
+    ~jpeg_row_encoder() override;
+    cairo_status_t write_rows(const unsigned char* rows, int stride,
+                              int count) override;
+    cairo_status_t finish() override;
+
+  private:
+    // libjpeg structures, kept out of this header
+    struct jpeg_state;
+    jpeg_state* m_state;
+};
+
 cairo_status_t write_to_vector(void* closure, const unsigned char* data,
                                unsigned int length);
 cairo_status_t read_from_view(void* closure, unsigned char* buffer,
                               unsigned int length);
-cairo_status_t cairo_surface_write_to_jpeg_mem(cairo_surface_t* sfc,
-                                               unsigned char** data, size_t* len,
-                                               int quality);
+cairo_status_t cairo_surface_write_to_png_stream_level(cairo_surface_t* sfc,
+                                                      cairo_write_func_t write_func,
+                                                      void* closure, int level,
+                                                      bool grayscale);
+cairo_status_t cairo_surface_write_to_png_palette_stream(cairo_surface_t* sfc,
+                                                        cairo_write_func_t write_func,
+                                                        void* closure, int level);
+cairo_status_t cairo_surface_write_to_jpeg_stream(cairo_surface_t* sfc,
+                                                  cairo_write_func_t write_func,
+                                                  void* closure,
+                                                  const jpeg_options& options);
+cairo_status_t cairo_surface_write_to_webp_stream(cairo_surface_t* sfc,
+                                                  cairo_write_func_t write_func,
+                                                  void* closure, int quality,
+                                                  bool lossless, int method);
+cairo_status_t cairo_surface_write_to_avif_stream(cairo_surface_t* sfc,
+                                                  cairo_write_func_t write_func,
+                                                  void* closure, int quality, int speed,
+                                                  int threads);
 cairo_surface_t* cairo_image_surface_create_from_jpeg_mem(void* data, size_t len);
 
 cairo_surface_t* cairo_image_surface_create_from_avif_mem(const uint8_t* data,
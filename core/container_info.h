@@ -23,6 +23,11 @@ License along with this library; if not, see <https://www.gnu.org/licenses/>.
 
 #include "litehtml/types.h"
 
+// Speed against fidelity of drawing. `fast` hints glyphs, rounds their metrics and
+// uses the cheapest antialiasing and image filter, `best` keeps glyphs at subpixel
+// positions and uses the finer antialiasing and image filter.
+enum class render_quality { fast, normal, best };
+
 struct container_info {
     litehtml::pixel_t dpi;
     litehtml::pixel_t width;
@@ -34,6 +39,7 @@ struct container_info {
     // The "CN" part in "zh-CN"
     std::string culture;
     cairo_font_options_t* font_options;
+    render_quality quality;
     bool native_data_scheme;
 };
 
@@ -38,7 +38,12 @@ class debug_container : public htmlkit_container {
   public:
     debug_container(const std::string& base_url, const container_info& info);
     std::string export_debug_layers();
-    void set_debug_surface(cairo_surface_t* surface) { m_dbg_surface = surface; }
+    // Text is drawn twice while debugging, on the page and on the debug surface, so
+    // runs of text draws can't stay open
+    void set_debug_surface(cairo_surface_t* surface) {
+        m_dbg_surface = surface;
+        m_batch_text = surface == nullptr;
+    }
     void draw_text(litehtml::uint_ptr hdc, const char* text, litehtml::uint_ptr hFont,
                    litehtml::web_color color, const litehtml::position& pos) override;
     void draw_list_marker(litehtml::uint_ptr hdc,
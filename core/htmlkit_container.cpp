@@ -17,11 +17,14 @@ License along with this library; if not, see <https://www.gnu.org/licenses/>.
 
 #include "htmlkit_container.h"
 #include "cairo_wrapper.h"
+#include <algorithm>
 #include <array>
+#include <cmath>
 #include <libbase64.h>
 #include <pango/pango-font.h>
 #include <pango/pango.h>
 #include <pango/pangocairo.h>
+#include <unordered_map>
 
 #pragma region BLANKET_IMPLS
 
@@ -56,12 +59,16 @@ litehtml::pixel_t htmlkit_container::get_default_font_size() const {
 
 void htmlkit_container::draw_list_marker(litehtml::uint_ptr hdc,
                                          const litehtml::list_marker& marker) {
+    if (is_culled((cairo_t*)hdc, marker.pos)) {
+        return;
+    }
+    end_text();
     if (!marker.image.empty()) {
         auto img = get_image(marker.image.c_str(), marker.baseurl);
         if (img) {
             draw_bmp((cairo_t*)hdc, img, marker.pos.x, marker.pos.y,
                      cairo_image_surface_get_width(img),
-                     cairo_image_surface_get_height(img));
+                     cairo_image_surface_get_height(img), image_filter());
             cairo_surface_destroy(img);
         }
     } else {
@@ -127,6 +134,10 @@ void htmlkit_container::draw_image(litehtml::uint_ptr hdc,
     }
 
     auto* cr = (cairo_t*)hdc;
+    if (is_culled(cr, layer.clip_box)) {
+        return;
+    }
+    end_text();
     cairo_save(cr);
     apply_clip(cr);
 
@@ -139,7 +150,8 @@ void htmlkit_container::draw_image(litehtml::uint_ptr hdc,
 
         if (image_width != cairo_image_surface_get_width(bgbmp) ||
             image_height != cairo_image_surface_get_height(bgbmp)) {
-            auto new_img = scale_surface(bgbmp, image_width, image_height);
+            auto new_img =
+                scale_surface(bgbmp, image_width, image_height, image_filter());
             cairo_surface_destroy(bgbmp);
             bgbmp = new_img;
         }
@@ -149,13 +161,14 @@ void htmlkit_container::draw_image(litehtml::uint_ptr hdc,
         cairo_matrix_init_identity(&flib_m);
         cairo_matrix_translate(&flib_m, -layer.origin_box.x, -layer.origin_box.y);
         cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
+        cairo_pattern_set_filter(pattern, image_filter());
         cairo_pattern_set_matrix(pattern, &flib_m);
 
         switch (layer.repeat) {
         case litehtml::background_repeat_no_repeat:
             draw_bmp(cr, bgbmp, layer.origin_box.x, layer.origin_box.y,
                      cairo_image_surface_get_width(bgbmp),
-                     cairo_image_surface_get_height(bgbmp));
+                     cairo_image_surface_get_height(bgbmp), image_filter());
             break;
 
         case litehtml::background_repeat_repeat_x:
@@ -196,6 +209,10 @@ void htmlkit_container::draw_solid_fill(litehtml::uint_ptr hdc,
     }
 
     auto* cr = (cairo_t*)hdc;
+    if (is_culled(cr, layer.clip_box)) {
+        return;
+    }
+    end_text();
     cairo_save(cr);
     apply_clip(cr);
 
@@ -207,12 +224,17 @@ void htmlkit_container::draw_solid_fill(litehtml::uint_ptr hdc,
     cairo_restore(cr);
 }
 
+// Number of tiles from which a repeated pattern is drawn through a tile surface
+static constexpr int min_surface_tiles = 4;
+
 /**
  * @brief Draw pattern using layer.repeat property.
  *
  * Pattern must be defined relatively to the (layer.origin_box.x, layer.origin_box.y)
  * point. Function calculates rectangles for repeat-x/repeat-y properties and transform
  * pattern to the correct position. Then call draw callback to draw single pattern.
+ * When there are many tiles the callback draws one tile onto a surface instead,
+ * which is then filled repeated over all of them.
  *
  * @param cr - cairo context
  * @param pattern - cairo pattern
@@ -274,6 +296,54 @@ static void draw_pattern(
         }
     }
 
+    // Many tiles are drawn once onto a surface of the tile's device size, which is
+    // then painted repeated in one fill like repeated images are. Tiles that don't
+    // cover whole device pixels would drift, they are drawn one by one. Similar
+    // surfaces are sized in units of the target's device scale, which they inherit,
+    // so the tile must be whole in those units too.
+    double device_width = layer.origin_box.width;
+    double device_height = layer.origin_box.height;
+    cairo_user_to_device_distance(cr, &device_width, &device_height);
+    device_width = std::abs(device_width);
+    device_height = std::abs(device_height);
+    double device_scale_x, device_scale_y;
+    cairo_surface_get_device_scale(cairo_get_target(cr), &device_scale_x,
+                                   &device_scale_y);
+    double tile_width = device_width / device_scale_x;
+    double tile_height = device_height / device_scale_y;
+    if (num_x * num_y >= min_surface_tiles && tile_width >= 1 && tile_height >= 1 &&
+        device_width == std::round(device_width) &&
+        device_height == std::round(device_height) &&
+        tile_width == std::round(tile_width) &&
+        tile_height == std::round(tile_height)) {
+        cairo_surface_t* tile = cairo_surface_create_similar(
+            cairo_get_target(cr), CAIRO_CONTENT_COLOR_ALPHA, (int)tile_width,
+            (int)tile_height);
+        cairo_t* tile_cr = cairo_create(tile);
+        double scale_x = tile_width / layer.origin_box.width;
+        double scale_y = tile_height / layer.origin_box.height;
+        cairo_scale(tile_cr, scale_x, scale_y);
+        cairo_matrix_t identity;
+        cairo_matrix_init_identity(&identity);
+        cairo_pattern_set_matrix(pattern, &identity);
+        draw(tile_cr, pattern, 0, 0, layer.origin_box.width, layer.origin_box.height);
+        cairo_destroy(tile_cr);
+
+        cairo_pattern_t* tiles = cairo_pattern_create_for_surface(tile);
+        cairo_pattern_set_extend(tiles, CAIRO_EXTEND_REPEAT);
+        cairo_matrix_t tiles_m;
+        cairo_matrix_init_scale(&tiles_m, scale_x, scale_y);
+        cairo_matrix_translate(&tiles_m, -start_x, -start_y);
+        cairo_pattern_set_matrix(tiles, &tiles_m);
+        cairo_set_source(cr, tiles);
+        cairo_rectangle(cr, start_x, start_y, num_x * layer.origin_box.width,
+                        num_y * layer.origin_box.height);
+        cairo_fill(cr);
+        cairo_pattern_destroy(tiles);
+        cairo_surface_destroy(tile);
+        return;
+    }
+
     for (int i_x = 0; i_x < num_x; i_x++) {
         for (int i_y = 0; i_y < num_y; i_y++) {
             cairo_matrix_t flib_m;
@@ -288,28 +358,78 @@ static void draw_pattern(
     }
 }
 
+// Upper bound of cached gradients per draw pass, the cache starts over when hit
+static constexpr size_t max_cached_gradients = 256;
+
+cairo_pattern_t*
+htmlkit_container::cached_gradient(std::vector<double>&& key,
+                                   const std::function<cairo_pattern_t*()>& create) {
+    auto& gradients = state().gradients;
+    auto it = gradients.find(key);
+    if (it != gradients.end()) {
+        return it->second;
+    }
+    cairo_pattern_t* pattern = create();
+    if (pattern == nullptr) {
+        return nullptr;
+    }
+    if (gradients.size() >= max_cached_gradients) {
+        for (const auto& [_, cached] : gradients) {
+            cairo_pattern_destroy(cached);
+        }
+        gradients.clear();
+    }
+    gradients.emplace(std::move(key), pattern);
+    return pattern;
+}
+
+static void add_color_stops_to_key(
+    std::vector<double>& key,
+    const std::vector<litehtml::background_layer::color_point>& color_points) {
+    for (const auto& color_stop : color_points) {
+        key.insert(key.end(), {color_stop.offset, (double)color_stop.color.red,
+                               (double)color_stop.color.green,
+                               (double)color_stop.color.blue,
+                               (double)color_stop.color.alpha});
+    }
+}
+
+static void add_color_stops(
+    cairo_pattern_t* pattern,
+    const std::vector<litehtml::background_layer::color_point>& color_points) {
+    for (const auto& color_stop : color_points) {
+        cairo_pattern_add_color_stop_rgba(
+            pattern, color_stop.offset, color_stop.color.red / 255.0,
+            color_stop.color.green / 255.0, color_stop.color.blue / 255.0,
+            color_stop.color.alpha / 255.0);
+    }
+}
+
 void htmlkit_container::draw_linear_gradient(
     litehtml::uint_ptr hdc, const litehtml::background_layer& layer,
     const litehtml::background_layer::linear_gradient& gradient) {
     auto* cr = (cairo_t*)hdc;
+    if (is_culled(cr, layer.clip_box)) {
+        return;
+    }
+    end_text();
     cairo_save(cr);
     apply_clip(cr);
 
     clip_background_layer(cr, layer);
 
     // Translate pattern to the (layer.origin_box.x, layer.origin_box.y) point
-    cairo_pattern_t* pattern =
-        cairo_pattern_create_linear(gradient.start.x - (float)layer.origin_box.x,
-                                    gradient.start.y - (float)layer.origin_box.y,
-                                    gradient.end.x - (float)layer.origin_box.x,
-                                    gradient.end.y - (float)layer.origin_box.y);
-
-    for (const auto& color_stop : gradient.color_points) {
-        cairo_pattern_add_color_stop_rgba(
-            pattern, color_stop.offset, color_stop.color.red / 255.0,
-            color_stop.color.green / 255.0, color_stop.color.blue / 255.0,
-            color_stop.color.alpha / 255.0);
-    }
+    float x0 = gradient.start.x - (float)layer.origin_box.x;
+    float y0 = gradient.start.y - (float)layer.origin_box.y;
+    float x1 = gradient.end.x - (float)layer.origin_box.x;
+    float y1 = gradient.end.y - (float)layer.origin_box.y;
+    std::vector<double> key = {0, x0, y0, x1, y1};
+    add_color_stops_to_key(key, gradient.color_points);
+    cairo_pattern_t* pattern = cached_gradient(std::move(key), [&]() {
+        cairo_pattern_t* linear = cairo_pattern_create_linear(x0, y0, x1, y1);
+        add_color_stops(linear, gradient.color_points);
+        return linear;
+    });
 
     draw_pattern(cr, pattern, layer,
                  [](cairo_t* cr, cairo_pattern_t* pattern, litehtml::pixel_t x,
@@ -320,7 +440,6 @@ void htmlkit_container::draw_linear_gradient(
                      cairo_fill(cr);
                  });
 
-    cairo_pattern_destroy(pattern);
     cairo_restore(cr);
 }
 
@@ -350,6 +469,10 @@ void htmlkit_container::draw_borders(litehtml::uint_ptr hdc,
                                      const litehtml::position& draw_pos,
                                      bool /*root*/) {
     auto* cr = (cairo_t*)hdc;
+    if (is_culled(cr, draw_pos)) {
+        return;
+    }
+    end_text();
     cairo_save(cr);
     apply_clip(cr);
 
@@ -375,6 +498,30 @@ void htmlkit_container::draw_borders(litehtml::uint_ptr hdc,
         bdr_right = borders.right.width;
     }
 
+    // Solid borders of a single color are one ring, filled in one go instead of
+    // side by side with the border machinery
+    const litehtml::border* sides[] = {&borders.left, &borders.top, &borders.right,
+                                       &borders.bottom};
+    const litehtml::pixel_t widths[] = {bdr_left, bdr_top, bdr_right, bdr_bottom};
+    const litehtml::web_color* ring_color = nullptr;
+    bool solid_ring = true;
+    for (int i = 0; i < 4 && solid_ring; i++) {
+        if (widths[i] == 0) {
+            continue;
+        }
+        if (sides[i]->style != litehtml::border_style_solid ||
+            (ring_color != nullptr && sides[i]->color != *ring_color)) {
+            solid_ring = false;
+        }
+        ring_color = &sides[i]->color;
+    }
+    if (solid_ring && ring_color != nullptr) {
+        draw_border_ring(cr, draw_pos, borders.radius, bdr_left, bdr_top, bdr_right,
+                         bdr_bottom, *ring_color);
+        cairo_restore(cr);
+        return;
+    }
+
     // draw right border
     if (bdr_right != 0) {
         cairo_matrix_t save_matrix;
@@ -472,24 +619,85 @@ void htmlkit_container::draw_borders(litehtml::uint_ptr hdc,
 void htmlkit_container::transform_text(litehtml::string& /*text*/,
                                        litehtml::text_transform /*tt*/) {}
 
+// Clips are set once per element but applied by every draw call inside it, so the
+// work is done here: plain rectangles are folded into the running intersection and
+// only rounded clips keep a path, built once on the scratch context.
 void htmlkit_container::set_clip(const litehtml::position& pos,
                                  const litehtml::border_radiuses& bdr_radius) {
-    m_clips.emplace_back(pos, bdr_radius);
+    end_text();
+    draw_state& st = state();
+    litehtml::position bounds = pos;
+    if (!st.clips.empty()) {
+        const litehtml::position& outer = st.clips.back().bounds;
+        litehtml::pixel_t left = std::max(pos.left(), outer.left());
+        litehtml::pixel_t top = std::max(pos.top(), outer.top());
+        litehtml::pixel_t right = std::max(left, std::min(pos.right(), outer.right()));
+        litehtml::pixel_t bottom =
+            std::max(top, std::min(pos.bottom(), outer.bottom()));
+        bounds = litehtml::position(left, top, right - left, bottom - top);
+    }
+    bool rounded = (bdr_radius.top_left_x != 0 && bdr_radius.top_left_y != 0) ||
+                   (bdr_radius.top_right_x != 0 && bdr_radius.top_right_y != 0) ||
+                   (bdr_radius.bottom_right_x != 0 && bdr_radius.bottom_right_y != 0) ||
+                   (bdr_radius.bottom_left_x != 0 && bdr_radius.bottom_left_y != 0);
+    cairo_path_t* path = nullptr;
+    if (rounded) {
+        rounded_rectangle(st.temp_cr, pos, bdr_radius);
+        path = cairo_copy_path(st.temp_cr);
+        cairo_new_path(st.temp_cr);
+    }
+    st.clips.push_back({bounds, path});
 }
 
 void htmlkit_container::del_clip() {
-    if (!m_clips.empty()) {
-        m_clips.pop_back();
+    end_text();
+    auto& clips = state().clips;
+    if (!clips.empty()) {
+        if (clips.back().path != nullptr) {
+            cairo_path_destroy(clips.back().path);
+        }
+        clips.pop_back();
     }
 }
 
 void htmlkit_container::apply_clip(cairo_t* cr) {
-    for (const auto& clip_box : m_clips) {
-        rounded_rectangle(cr, clip_box.box, clip_box.radius);
-        cairo_clip(cr);
+    const auto& clips = state().clips;
+    if (clips.empty()) {
+        return;
+    }
+    // One rectangle clip, which cairo keeps as boxes when it is pixel aligned
+    const litehtml::position& bounds = clips.back().bounds;
+    cairo_new_path(cr);
+    cairo_rectangle(cr, bounds.x, bounds.y, bounds.width, bounds.height);
+    cairo_clip(cr);
+    for (const auto& clip : clips) {
+        if (clip.path != nullptr) {
+            cairo_append_path(cr, clip.path);
+            cairo_clip(cr);
+        }
     }
 }
 
+bool htmlkit_container::is_culled(cairo_t* cr, const litehtml::position& pos,
+                                  litehtml::pixel_t margin) {
+    double left, top, right, bottom;
+    cairo_clip_extents(cr, &left, &top, &right, &bottom);
+    const auto& clips = state().clips;
+    if (!clips.empty()) {
+        const litehtml::position& bounds = clips.back().bounds;
+        left = std::max<double>(left, bounds.left());
+        top = std::max<double>(top, bounds.top());
+        right = std::min<double>(right, bounds.right());
+        bottom = std::min<double>(bottom, bounds.bottom());
+    }
+    if (pos.right() + margin <= left || pos.left() - margin >= right ||
+        pos.bottom() + margin <= top || pos.top() - margin >= bottom) {
+        m_culled_draws.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
 void htmlkit_container::draw_ellipse(cairo_t* cr, litehtml::pixel_t x,
                                      litehtml::pixel_t y, litehtml::pixel_t width,
                                      litehtml::pixel_t height,
@@ -548,9 +756,47 @@ htmlkit_container::create_element(const char* tag_name,
     return nullptr;
 }
 
+void htmlkit_container::draw_border_ring(cairo_t* cr, const litehtml::position& pos,
+                                         const litehtml::border_radiuses& radius,
+                                         litehtml::pixel_t left, litehtml::pixel_t top,
+                                         litehtml::pixel_t right,
+                                         litehtml::pixel_t bottom,
+                                         const litehtml::web_color& color) {
+    cairo_new_path(cr);
+    add_rounded_rectangle(cr, pos, radius);
+    litehtml::position inner(pos.x + left, pos.y + top, pos.width - left - right,
+                             pos.height - top - bottom);
+    if (inner.width > 0 && inner.height > 0) {
+        // The padding edge curves with the outer radius less the border width
+        auto shrink = [](litehtml::pixel_t r, litehtml::pixel_t w) {
+            return std::max<litehtml::pixel_t>(r - w, 0);
+        };
+        litehtml::border_radiuses inner_radius = radius;
+        inner_radius.top_left_x = shrink(radius.top_left_x, left);
+        inner_radius.top_left_y = shrink(radius.top_left_y, top);
+        inner_radius.top_right_x = shrink(radius.top_right_x, right);
+        inner_radius.top_right_y = shrink(radius.top_right_y, top);
+        inner_radius.bottom_right_x = shrink(radius.bottom_right_x, right);
+        inner_radius.bottom_right_y = shrink(radius.bottom_right_y, bottom);
+        inner_radius.bottom_left_x = shrink(radius.bottom_left_x, left);
+        inner_radius.bottom_left_y = shrink(radius.bottom_left_y, bottom);
+        add_rounded_rectangle(cr, inner, inner_radius);
+    }
+    cairo_set_fill_rule(cr, CAIRO_FILL_RULE_EVEN_ODD);
+    set_color(cr, color);
+    cairo_fill(cr);
+}
+
 void htmlkit_container::rounded_rectangle(cairo_t* cr, const litehtml::position& pos,
                                           const litehtml::border_radiuses& radius) {
     cairo_new_path(cr);
+    add_rounded_rectangle(cr, pos, radius);
+}
+
+void htmlkit_container::add_rounded_rectangle(cairo_t* cr,
+                                              const litehtml::position& pos,
+                                              const litehtml::border_radiuses& radius) {
+    cairo_new_sub_path(cr);
     if (radius.top_left_x != 0 && radius.top_left_y != 0) {
         add_path_arc(cr, pos.left() + radius.top_left_x, pos.top() + radius.top_left_y,
                      radius.top_left_x, radius.top_left_y, M_PI, M_PI * 3.0 / 2.0,
@@ -567,7 +813,7 @@ void htmlkit_container::rounded_rectangle(cairo_t* cr, const litehtml::position&
                      radius.top_right_y, M_PI * 3.0 / 2.0, 2.0 * M_PI, false);
     }
 
-    cairo_line_to(cr, pos.right(), pos.bottom() - radius.bottom_right_x);
+    cairo_line_to(cr, pos.right(), pos.bottom() - radius.bottom_right_y);
 
     if (radius.bottom_right_x != 0 && radius.bottom_right_y != 0) {
         add_path_arc(cr, pos.right() - radius.bottom_right_x,
@@ -575,24 +821,25 @@ void htmlkit_container::rounded_rectangle(cairo_t* cr, const litehtml::position&
                      radius.bottom_right_y, 0, M_PI / 2.0, false);
     }
 
-    cairo_line_to(cr, pos.left() - radius.bottom_left_x, pos.bottom());
+    cairo_line_to(cr, pos.left() + radius.bottom_left_x, pos.bottom());
 
     if (radius.bottom_left_x != 0 && radius.bottom_left_y != 0) {
         add_path_arc(cr, pos.left() + radius.bottom_left_x,
                      pos.bottom() - radius.bottom_left_y, radius.bottom_left_x,
                      radius.bottom_left_y, M_PI / 2.0, M_PI, false);
     }
+    cairo_close_path(cr);
 }
 
 cairo_surface_t* htmlkit_container::scale_surface(cairo_surface_t* surface, int width,
-                                                  int height) {
+                                                  int height, cairo_filter_t filter) {
     int s_width = cairo_image_surface_get_width(surface);
     int s_height = cairo_image_surface_get_height(surface);
     cairo_surface_t* result = cairo_surface_create_similar(
         surface, cairo_surface_get_content(surface), width, height);
     cairo_pattern_t* pattern = cairo_pattern_create_for_surface(surface);
     cairo_t* cr = cairo_create(result);
-    cairo_pattern_set_filter(pattern, CAIRO_FILTER_BILINEAR);
+    cairo_pattern_set_filter(pattern, filter);
     cairo_pattern_set_extend(pattern, CAIRO_EXTEND_PAD);
     cairo_scale(cr, (double)width / (double)s_width, (double)height / (double)s_height);
     cairo_set_source(cr, pattern);
@@ -604,7 +851,8 @@ cairo_surface_t* htmlkit_container::scale_surface(cairo_surface_t* surface, int
 }
 
 void htmlkit_container::draw_bmp(cairo_t* cr, cairo_surface_t* bmp, litehtml::pixel_t x,
-                                 litehtml::pixel_t y, int cx, int cy) {
+                                 litehtml::pixel_t y, int cx, int cy,
+                                 cairo_filter_t filter) {
     cairo_save(cr);
 
     {
@@ -613,12 +861,15 @@ void htmlkit_container::draw_bmp(cairo_t* cr, cairo_surface_t* bmp, litehtml::pi
 
         if (cx != cairo_image_surface_get_width(bmp) ||
             cy != cairo_image_surface_get_height(bmp)) {
-            auto bmp_scaled = scale_surface(bmp, cx, cy);
+            auto bmp_scaled = scale_surface(bmp, cx, cy, filter);
             cairo_set_source_surface(cr, bmp_scaled, x, y);
+            // Still resampled when drawn at a device scale
+            cairo_pattern_set_filter(cairo_get_source(cr), filter);
             cairo_paint(cr);
             cairo_surface_destroy(bmp_scaled);
         } else {
             cairo_set_source_surface(cr, bmp, x, y);
+            cairo_pattern_set_filter(cairo_get_source(cr), filter);
             cairo_paint(cr);
         }
     }
@@ -655,6 +906,10 @@ void htmlkit_container::draw_radial_gradient(
     litehtml::uint_ptr hdc, const litehtml::background_layer& layer,
     const litehtml::background_layer::radial_gradient& gradient) {
     auto* cr = (cairo_t*)hdc;
+    if (is_culled(cr, layer.clip_box)) {
+        return;
+    }
+    end_text();
     cairo_save(cr);
     apply_clip(cr);
 
@@ -665,15 +920,14 @@ void htmlkit_container::draw_radial_gradient(
     position.x -= (float)layer.origin_box.x;
     position.y -= (float)layer.origin_box.y;
 
-    cairo_pattern_t* pattern = cairo_pattern_create_radial(
-        position.x, position.y, 0, position.x, position.y, gradient.radius.x);
-
-    for (const auto& color_stop : gradient.color_points) {
-        cairo_pattern_add_color_stop_rgba(
-            pattern, color_stop.offset, color_stop.color.red / 255.0,
-            color_stop.color.green / 255.0, color_stop.color.blue / 255.0,
-            color_stop.color.alpha / 255.0);
-    }
+    std::vector<double> key = {1, position.x, position.y, gradient.radius.x};
+    add_color_stops_to_key(key, gradient.color_points);
+    cairo_pattern_t* pattern = cached_gradient(std::move(key), [&]() {
+        cairo_pattern_t* radial = cairo_pattern_create_radial(
+            position.x, position.y, 0, position.x, position.y, gradient.radius.x);
+        add_color_stops(radial, gradient.color_points);
+        return radial;
+    });
 
     draw_pattern(cr, pattern, layer,
                  [&gradient, &position](cairo_t* cr, cairo_pattern_t* pattern,
@@ -706,7 +960,6 @@ void htmlkit_container::draw_radial_gradient(
                      cairo_set_matrix(cr, &save_matrix);
                  });
 
-    cairo_pattern_destroy(pattern);
     cairo_restore(cr);
 }
 
@@ -714,16 +967,28 @@ void htmlkit_container::draw_conic_gradient(
     litehtml::uint_ptr hdc, const litehtml::background_layer& layer,
     const litehtml::background_layer::conic_gradient& gradient) {
     auto* cr = (cairo_t*)hdc;
+    if (is_culled(cr, layer.clip_box)) {
+        return;
+    }
+    end_text();
     cairo_save(cr);
     apply_clip(cr);
 
     clip_background_layer(cr, layer);
 
-    cairo_pattern_t* pattern = cairo_wrapper::conic_gradient::create_pattern(
-        gradient.angle * M_PI / 180.0 - M_PI / 2.0, gradient.radius,
-        gradient.color_points);
-    if (!pattern)
+    // The mesh only depends on the angle, radius and stops, the center is set
+    // through the pattern matrix
+    std::vector<double> key = {2, gradient.angle, gradient.radius};
+    add_color_stops_to_key(key, gradient.color_points);
+    cairo_pattern_t* pattern = cached_gradient(std::move(key), [&]() {
+        return cairo_wrapper::conic_gradient::create_pattern(
+            gradient.angle * M_PI / 180.0 - M_PI / 2.0, gradient.radius,
+            gradient.color_points);
+    });
+    if (!pattern) {
+        cairo_restore(cr);
         return;
+    }
 
     // Translate a pattern to the (layer.origin_box.x, layer.origin_box.y) point
     litehtml::pointF position = gradient.position;
@@ -744,7 +1009,6 @@ void htmlkit_container::draw_conic_gradient(
                      cairo_fill(cr);
                  });
 
-    cairo_pattern_destroy(pattern);
     cairo_restore(cr);
 }
 
@@ -794,8 +1058,9 @@ htmlkit_container::create_font(const litehtml::font_description& descr,
     if (fm) {
         fm->font_size = descr.size;
 
-        cairo_save(m_temp_cr);
-        PangoLayout* layout = pango_cairo_create_layout(m_temp_cr);
+        cairo_t* temp_cr = state().temp_cr;
+        cairo_save(temp_cr);
+        PangoLayout* layout = create_layout(temp_cr, true);
         PangoContext* context = pango_layout_get_context(layout);
         PangoLanguage* language = pango_language_get_default();
         pango_layout_set_font_description(layout, desc);
@@ -824,7 +1089,7 @@ htmlkit_container::create_font(const litehtml::font_description& descr,
         pango_layout_get_pixel_extents(layout, &ink_rect, &logical_rect);
         fm->ch_width = logical_rect.width;
 
-        cairo_restore(m_temp_cr);
+        cairo_restore(temp_cr);
 
         ret = new cairo_font;
         ret->font = desc;
@@ -901,19 +1166,20 @@ void htmlkit_container::delete_font(litehtml::uint_ptr hFont) {
 litehtml::pixel_t htmlkit_container::text_width(const char* text,
                                                 litehtml::uint_ptr hFont) {
     auto* fnt = (cairo_font*)hFont;
+    cairo_t* temp_cr = state().temp_cr;
 
-    cairo_save(m_temp_cr);
+    cairo_save(temp_cr);
 
-    PangoLayout* layout = pango_cairo_create_layout(m_temp_cr);
+    PangoLayout* layout = create_layout(temp_cr, true);
     pango_layout_set_font_description(layout, fnt->font);
 
     pango_layout_set_text(layout, text, -1);
-    pango_cairo_update_layout(m_temp_cr, layout);
+    pango_cairo_update_layout(temp_cr, layout);
 
     int x_width, x_height;
     pango_layout_get_pixel_size(layout, &x_width, &x_height);
 
-    cairo_restore(m_temp_cr);
+    cairo_restore(temp_cr);
 
     g_object_unref(layout);
 
@@ -987,24 +1253,30 @@ static void draw_dashed_line(cairo_t* cr, litehtml::pixel_t x, litehtml::pixel_t
     cairo_stroke(cr);
 }
 
-static void draw_wavy_line(cairo_t* cr, litehtml::pixel_t x, litehtml::pixel_t y,
-                           litehtml::pixel_t width, int thickness, draw_type type,
-                           litehtml::web_color& color) {
-    int h_pad = 1;
-    int brush_height = (int)thickness * 3 + h_pad * 2;
-    int brush_width = brush_height * 2 - 2 * thickness;
+// Repeat patterns of wavy line brushes by thickness and color. Kept per thread, so
+// bands drawn in parallel never share a pattern matrix, and freed with the thread.
+struct wavy_brush_cache {
+    std::unordered_map<uint64_t, cairo_pattern_t*> patterns;
 
-    double top;
-    switch (type) {
-    case draw_type::DRAW_UNDERLINE:
-        top = y + (double)brush_height / 2.0;
-        break;
-    case draw_type::DRAW_OVERLINE:
-        top = y - (double)brush_height / 2.0;
-        break;
-    default:
-        top = y;
-        break;
+    ~wavy_brush_cache() {
+        for (const auto& [_, pattern] : patterns) {
+            cairo_pattern_destroy(pattern);
+        }
+    }
+};
+
+// Upper bound of cached brushes per thread, the cache starts over when hit
+static constexpr size_t max_wavy_brushes = 64;
+
+static cairo_pattern_t* wavy_brush(int thickness, const litehtml::web_color& color,
+                                   int brush_width, int brush_height, int h_pad) {
+    static thread_local wavy_brush_cache cache;
+    uint64_t key = (uint64_t)(uint32_t)thickness << 32 | (uint32_t)color.red << 24 |
+                   (uint32_t)color.green << 16 | (uint32_t)color.blue << 8 |
+                   color.alpha;
+    auto it = cache.patterns.find(key);
+    if (it != cache.patterns.end()) {
+        return it->second;
     }
 
     cairo_surface_t* brush_surface =
@@ -1029,6 +1301,41 @@ static void draw_wavy_line(cairo_t* cr, litehtml::pixel_t x, litehtml::pixel_t y
 
     cairo_pattern_t* pattern = cairo_pattern_create_for_surface(brush_surface);
     cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
+    // The pattern holds its own reference
+    cairo_surface_destroy(brush_surface);
+
+    if (cache.patterns.size() >= max_wavy_brushes) {
+        for (const auto& [_, cached] : cache.patterns) {
+            cairo_pattern_destroy(cached);
+        }
+        cache.patterns.clear();
+    }
+    cache.patterns.emplace(key, pattern);
+    return pattern;
+}
+
+static void draw_wavy_line(cairo_t* cr, litehtml::pixel_t x, litehtml::pixel_t y,
+                           litehtml::pixel_t width, int thickness, draw_type type,
+                           litehtml::web_color& color) {
+    int h_pad = 1;
+    int brush_height = (int)thickness * 3 + h_pad * 2;
+    int brush_width = brush_height * 2 - 2 * thickness;
+
+    double top;
+    switch (type) {
+    case draw_type::DRAW_UNDERLINE:
+        top = y + (double)brush_height / 2.0;
+        break;
+    case draw_type::DRAW_OVERLINE:
+        top = y - (double)brush_height / 2.0;
+        break;
+    default:
+        top = y;
+        break;
+    }
+
+    cairo_pattern_t* pattern =
+        wavy_brush(thickness, color, brush_width, brush_height, h_pad);
     cairo_matrix_t patterm_matrix;
     cairo_matrix_init_translate(&patterm_matrix, 0, -top + brush_height / 2.0);
     cairo_pattern_set_matrix(pattern, &patterm_matrix);
@@ -1038,9 +1345,6 @@ static void draw_wavy_line(cairo_t* cr, litehtml::pixel_t x, litehtml::pixel_t y
     cairo_move_to(cr, x, top);
     cairo_line_to(cr, x + width, top);
     cairo_stroke(cr);
-
-    cairo_pattern_destroy(pattern);
-    cairo_surface_destroy(brush_surface);
 }
 
 static void draw_double_line(cairo_t* cr, litehtml::pixel_t x, litehtml::pixel_t y,
@@ -1082,23 +1386,18 @@ void htmlkit_container::draw_text(litehtml::uint_ptr hdc, const char* text,
                                   const litehtml::position& pos) {
     auto* fnt = (cairo_font*)hFont;
     auto* cr = (cairo_t*)hdc;
-    cairo_save(cr);
-
-    apply_clip(cr);
+    // Glyph ink may reach past the text box, italics and accents mostly
+    if (is_culled(cr, pos, pos.height)) {
+        return;
+    }
+    PangoLayout* layout = begin_text(cr, hFont);
 
     set_color(cr, color);
 
     litehtml::web_color decoration_color = color;
 
-    PangoLayout* layout = pango_cairo_create_layout(cr);
-    pango_layout_set_font_description(layout, fnt->font);
     pango_layout_set_text(layout, text, -1);
 
-    if (auto font_options = m_info.font_options) {
-        auto ctx = pango_layout_get_context(layout);
-        pango_cairo_context_set_font_options(ctx, font_options);
-    }
-
     PangoRectangle ink_rect, logical_rect;
     pango_layout_get_pixel_extents(layout, &ink_rect, &logical_rect);
 
@@ -1111,47 +1410,125 @@ void htmlkit_container::draw_text(litehtml::uint_ptr hdc, const char* text,
     pango_cairo_update_layout(cr, layout);
     pango_cairo_show_layout(cr, layout);
 
-    litehtml::pixel_t tw = 0;
-
     if (fnt->underline || fnt->strikeout || fnt->overline) {
-        tw = text_width(text, hFont);
-    }
+        // Decorations set line caps and dashes, which must not leak into the run
+        cairo_save(cr);
 
-    if (!fnt->decoration_color.is_current_color) {
-        decoration_color = fnt->decoration_color;
-    }
+        litehtml::pixel_t tw = text_width(text, hFont);
 
-    std::array<decltype(&draw_solid_line), litehtml::text_decoration_style_max>
-        draw_funcs{
-            draw_solid_line,  // text_decoration_style_solid
-            draw_double_line, // text_decoration_style_double
-            draw_dotted_line, // text_decoration_style_dotted
-            draw_dashed_line, // text_decoration_style_dashed
-            draw_wavy_line,   // text_decoration_style_wavy
-        };
+        if (!fnt->decoration_color.is_current_color) {
+            decoration_color = fnt->decoration_color;
+        }
+
+        std::array<decltype(&draw_solid_line), litehtml::text_decoration_style_max>
+            draw_funcs{
+                draw_solid_line,  // text_decoration_style_solid
+                draw_double_line, // text_decoration_style_double
+                draw_dotted_line, // text_decoration_style_dotted
+                draw_dashed_line, // text_decoration_style_dashed
+                draw_wavy_line,   // text_decoration_style_wavy
+            };
+
+        if (fnt->underline) {
+            draw_funcs[fnt->decoration_style](
+                cr, x, pos.top() + text_baseline + fnt->underline_position, tw,
+                fnt->underline_thickness, draw_type::DRAW_UNDERLINE, decoration_color);
+        }
+
+        if (fnt->strikeout) {
+            draw_funcs[fnt->decoration_style](
+                cr, x, pos.top() + text_baseline - fnt->strikethrough_position, tw,
+                fnt->strikethrough_thickness, draw_type::DRAW_STRIKETHROUGH,
+                decoration_color);
+        }
+
+        if (fnt->overline) {
+            draw_funcs[fnt->decoration_style](
+                cr, x, pos.top() + text_baseline - fnt->overline_position, tw,
+                fnt->overline_thickness, draw_type::DRAW_OVERLINE, decoration_color);
+        }
 
-    if (fnt->underline) {
-        draw_funcs[fnt->decoration_style](
-            cr, x, pos.top() + text_baseline + fnt->underline_position, tw,
-            fnt->underline_thickness, draw_type::DRAW_UNDERLINE, decoration_color);
+        cairo_restore(cr);
     }
 
-    if (fnt->strikeout) {
-        draw_funcs[fnt->decoration_style](
-            cr, x, pos.top() + text_baseline - fnt->strikethrough_position, tw,
-            fnt->strikethrough_thickness, draw_type::DRAW_STRIKETHROUGH,
-            decoration_color);
+    if (!m_batch_text) {
+        end_text();
     }
+}
 
-    if (fnt->overline) {
-        draw_funcs[fnt->decoration_style](
-            cr, x, pos.top() + text_baseline - fnt->overline_position, tw,
-            fnt->overline_thickness, draw_type::DRAW_OVERLINE, decoration_color);
+// Consecutive words of a paragraph share one saved cairo state with the clip applied
+// and one layout, instead of paying for both on every word. Words keep their own
+// layout pass, litehtml placed each of them at its rounded width.
+PangoLayout* htmlkit_container::begin_text(cairo_t* cr, litehtml::uint_ptr hFont) {
+    auto& run = state().text;
+    if (run.cr != cr) {
+        end_text();
+        cairo_save(cr);
+        apply_clip(cr);
+        run.cr = cr;
+        run.layout = create_layout(cr, false);
+        run.font = 0;
     }
+    if (run.font != hFont) {
+        pango_layout_set_font_description(run.layout, ((cairo_font*)hFont)->font);
+        run.font = hFont;
+    }
+    return run.layout;
+}
 
-    cairo_restore(cr);
+// Layouts for drawing take the font options of the preset. Layouts for measuring
+// only take them when the preset changes metrics, so `normal` keeps measuring with
+// the options of the surface as it always has.
+PangoLayout* htmlkit_container::create_layout(cairo_t* cr, bool measure) {
+    PangoLayout* layout = pango_cairo_create_layout(cr);
+    PangoContext* ctx = pango_layout_get_context(layout);
+    if (m_info.font_options != nullptr &&
+        (!measure || m_info.quality != render_quality::normal)) {
+        pango_cairo_context_set_font_options(ctx, m_info.font_options);
+    }
+#if PANGO_VERSION_CHECK(1, 44, 0)
+    // Subpixel positioning, glyphs keep the fractional advances of unhinted metrics
+    if (m_info.quality == render_quality::best) {
+        pango_context_set_round_glyph_positions(ctx, FALSE);
+    }
+#endif
+    return layout;
+}
 
-    g_object_unref(layout);
+void htmlkit_container::apply_quality(cairo_t* cr) const {
+    switch (m_info.quality) {
+    case render_quality::fast:
+        cairo_set_antialias(cr, CAIRO_ANTIALIAS_FAST);
+        break;
+    case render_quality::best:
+        cairo_set_antialias(cr, CAIRO_ANTIALIAS_GOOD);
+        break;
+    default:
+        break;
+    }
+}
+
+cairo_filter_t htmlkit_container::image_filter() const {
+    switch (m_info.quality) {
+    case render_quality::fast:
+        return CAIRO_FILTER_FAST;
+    case render_quality::best:
+        return CAIRO_FILTER_GOOD;
+    default:
+        return CAIRO_FILTER_BILINEAR;
+    }
+}
+
+void htmlkit_container::end_text() {
+    auto& run = state().text;
+    if (run.cr == nullptr) {
+        return;
+    }
+    cairo_restore(run.cr);
+    g_object_unref(run.layout);
+    run.cr = nullptr;
+    run.layout = nullptr;
+    run.font = 0;
 }
 
 #pragma endregion
@@ -1161,10 +1538,8 @@ void htmlkit_container::draw_text(litehtml::uint_ptr hdc, const char* text,
 htmlkit_container::htmlkit_container(const std::string& base_url,
                                      const container_info& info)
     : m_base_url(base_url), m_info(info) {
-    m_temp_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 2, 2);
-    m_temp_cr = cairo_create(m_temp_surface);
-    cairo_save(m_temp_cr);
-    PangoLayout* layout = pango_cairo_create_layout(m_temp_cr);
+    cairo_save(m_state.temp_cr);
+    PangoLayout* layout = pango_cairo_create_layout(m_state.temp_cr);
     PangoContext* context = pango_layout_get_context(layout);
     PangoFontFamily** families;
     int n;
@@ -1178,18 +1553,45 @@ htmlkit_container::htmlkit_container(const std::string& base_url,
         m_all_fonts.insert(font_name);
     }
     g_free(families);
-    cairo_restore(m_temp_cr);
+    cairo_restore(m_state.temp_cr);
     g_object_unref(layout);
 }
 
 htmlkit_container::~htmlkit_container() {
-    cairo_surface_destroy(m_temp_surface);
-    cairo_destroy(m_temp_cr);
     for (auto& [_, surface] : m_img_surfaces) {
         cairo_surface_destroy(surface);
     }
 }
 
+thread_local htmlkit_container::draw_state* htmlkit_container::t_band_state = nullptr;
+
+htmlkit_container::draw_state::draw_state() {
+    temp_surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, 2, 2);
+    temp_cr = cairo_create(temp_surface);
+}
+
+htmlkit_container::draw_state::~draw_state() {
+    for (const auto& clip : clips) {
+        if (clip.path != nullptr) {
+            cairo_path_destroy(clip.path);
+        }
+    }
+    for (const auto& [_, pattern] : gradients) {
+        cairo_pattern_destroy(pattern);
+    }
+    if (text.layout != nullptr) {
+        g_object_unref(text.layout);
+    }
+    cairo_destroy(temp_cr);
+    cairo_surface_destroy(temp_surface);
+}
+
+htmlkit_container::band_scope::band_scope() : m_prev(t_band_state) {
+    t_band_state = &m_state;
+}
+
+htmlkit_container::band_scope::~band_scope() { t_band_state = m_prev; }
+
 void htmlkit_container::set_base_url(const char* base_url) {
     if (base_url != nullptr) {
         m_base_url = base_url;
@@ -1292,6 +1694,9 @@ void htmlkit_container::load_image(const char* src, const char* baseurl,
     m_img_fetch_waiters.emplace_back(src, baseurl, std::move(waiter));
 }
 void htmlkit_container::process_images() {
+    if (m_img_fetch_waiters.empty()) {
+        return;
+    }
     GILState gil;
     for (auto& [src, baseurl, waiter] : m_img_fetch_waiters) {
         PyObjectPtr image(waiter_wait(waiter.get()));
@@ -21,6 +21,9 @@ License along with this library; if not, see <https://www.gnu.org/licenses/>.
 #include <Python.h>
 #include <cairo.h>
 #include <litehtml.h>
+#include <pango/pango.h>
+#include <atomic>
+#include <functional>
 #include <map>
 #include <set>
 #include <utility>
@@ -30,9 +33,56 @@ License along with this library; if not, see <https://www.gnu.org/licenses/>.
 #include "py_synchron.h"
 
 class htmlkit_container : public litehtml::document_container {
-    cairo_wrapper::clip_box::vector m_clips;
-    cairo_surface_t* m_temp_surface;
-    cairo_t* m_temp_cr;
+  public:
+    // Mutable state of a draw pass. Layout and single threaded drawing use the one
+    // owned by the container, threads drawing bands in parallel bind their own
+    // through a `band_scope`.
+    struct draw_state {
+        // One entry per `set_clip`. `bounds` is the intersection of the boxes of
+        // this clip and all below it, `path` the outline of this clip if it has
+        // rounded corners and nullptr if `bounds` covers it.
+        struct clip_entry {
+            litehtml::position bounds;
+            cairo_path_t* path;
+        };
+        std::vector<clip_entry> clips;
+        // Gradient patterns drawn in this pass, by kind, geometry relative to the
+        // origin box and color stops. Repeats only differ in the pattern matrix.
+        std::map<std::vector<double>, cairo_pattern_t*> gradients;
+        // Open run of `draw_text` calls on `cr`, which holds a saved state with the
+        // clip applied. nullptr `cr` when no run is open.
+        struct text_run {
+            cairo_t* cr = nullptr;
+            PangoLayout* layout = nullptr;
+            litehtml::uint_ptr font = 0;
+        } text;
+        cairo_surface_t* temp_surface;
+        cairo_t* temp_cr;
+
+        draw_state();
+        ~draw_state();
+        draw_state(const draw_state&) = delete;
+        draw_state& operator=(const draw_state&) = delete;
+    };
+
+    class band_scope {
+        draw_state m_state;
+        draw_state* m_prev;
+
+      public:
+        band_scope();
+        ~band_scope();
+    };
+
+  protected:
+    // Keep text runs open between `draw_text` calls, containers that look at the
+    // surface after every call turn it off
+    bool m_batch_text = true;
+
+  private:
+    static thread_local draw_state* t_band_state;
+    draw_state m_state;
+    std::atomic<uint64_t> m_culled_draws{0};
     std::set<std::string> m_all_fonts;
     std::string m_base_url;
 
@@ -112,6 +162,17 @@ class htmlkit_container : public litehtml::document_container {
                                         const litehtml::string& new_baseurl)>&
                    on_imported) override;
     cairo_surface_t* get_image(const char* url, const char* baseurl);
+    // Waits for pending image fetches, must be called before drawing in parallel
+    void process_images();
+    // Ends the run of text draws, must be called once `draw` returns and before the
+    // context it was given is destroyed
+    void end_text();
+    // Number of draw calls skipped because they fell outside the clip, summed over
+    // every pass over the document, so an element is counted once per page or band
+    uint64_t culled_draws() const { return m_culled_draws.load(); }
+    // Sets the shape antialiasing of the quality preset on a context `draw` is
+    // given
+    void apply_quality(cairo_t* cr) const;
 
   protected:
     void draw_ellipse(cairo_t* cr, litehtml::pixel_t x, litehtml::pixel_t y,
@@ -122,9 +183,35 @@ class htmlkit_container : public litehtml::document_container {
                       const litehtml::web_color& color);
     void rounded_rectangle(cairo_t* cr, const litehtml::position& pos,
                            const litehtml::border_radiuses& radius);
+    // Adds the rounded rectangle as a closed sub path of the current path
+    void add_rounded_rectangle(cairo_t* cr, const litehtml::position& pos,
+                               const litehtml::border_radiuses& radius);
+    // Fills solid borders of one color, `left` to `bottom` being their widths, as
+    // the ring between the border box and the padding box
+    void draw_border_ring(cairo_t* cr, const litehtml::position& pos,
+                          const litehtml::border_radiuses& radius,
+                          litehtml::pixel_t left, litehtml::pixel_t top,
+                          litehtml::pixel_t right, litehtml::pixel_t bottom,
+                          const litehtml::web_color& color);
 
     void clip_background_layer(cairo_t* cr, const litehtml::background_layer& layer);
+    // Pattern of the draw state for `key`, made by `create` on first use. Owned by
+    // the draw state, nullptr if `create` failed.
+    cairo_pattern_t* cached_gradient(std::vector<double>&& key,
+                                     const std::function<cairo_pattern_t*()>& create);
     void apply_clip(cairo_t* cr);
+    // Starts or continues the run of text draws on `cr`, returns its layout set to
+    // the font
+    PangoLayout* begin_text(cairo_t* cr, litehtml::uint_ptr hFont);
+    // Whether `pos`, grown by `margin` on every side, misses the clip stack and the
+    // clip of `cr`. Counts the draw call as culled if so.
+    bool is_culled(cairo_t* cr, const litehtml::position& pos,
+                   litehtml::pixel_t margin = 0);
+    draw_state& state() { return t_band_state != nullptr ? *t_band_state : m_state; }
+    // Layout on `cr` set up for the quality preset
+    PangoLayout* create_layout(cairo_t* cr, bool measure);
+    // Filter for images drawn at another size than their own
+    cairo_filter_t image_filter() const;
 
     static void set_color(cairo_t* cr, const litehtml::web_color& color) {
         cairo_set_source_rgba(cr, color.red / 255.0, color.green / 255.0,
@@ -135,10 +222,9 @@ class htmlkit_container : public litehtml::document_container {
     static void add_path_arc(cairo_t* cr, double x, double y, double rx, double ry,
                              double a1, double a2, bool neg);
     static void draw_bmp(cairo_t* cr, cairo_surface_t* bmp, litehtml::pixel_t x,
-                         litehtml::pixel_t y, int cx, int cy);
+                         litehtml::pixel_t y, int cx, int cy, cairo_filter_t filter);
     static cairo_surface_t* scale_surface(cairo_surface_t* surface, int width,
-                                          int height);
-    void process_images();
+                                          int height, cairo_filter_t filter);
     void handle_exception() const;
     std::string call_urljoin(const char* base, const char* url);
 };
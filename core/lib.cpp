@@ -16,37 +16,582 @@ License along with this library; if not, see <https://www.gnu.org/licenses/>.
 */
 
 #include <Python.h>
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <condition_variable>
 #include <fontconfig/fontconfig.h>
 #include <litehtml.h>
 #include <litehtml/render_item.h>
+#include <memory>
+#include <mutex>
 #include <thread>
 #include <utility>
+#include <vector>
 
 #include "cairo_wrapper.h"
 #include "container_info.h"
 #include "debug_container.h"
 #include "font_wrapper.h"
+#include "py_synchron.h"
+#include "render_options.h"
+
+static void append_key(std::string& key, const char* value) {
+    size_t len = strlen(value);
+    key.append(reinterpret_cast<const char*>(&len), sizeof(len));
+    key.append(value, len);
+}
+
+template <typename T> static void append_key(std::string& key, const T& value) {
+    key.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// Schedules `future.method(value)` on the event loop. The GIL must be held.
+static bool schedule_on_loop(PyObject* loop, PyObject* future, const char* method,
+                             PyObject* value) {
+    PyObjectPtr callback(PyObject_GetAttrString(future, method));
+    if (callback == nullptr) {
+        return false;
+    }
+    PyObjectPtr scheduled(
+        PyObject_CallMethod(loop, "call_soon_threadsafe", "OO", callback.ptr, value));
+    return scheduled != nullptr;
+}
+
+// Resolves every future waiting on the flight `key` by scheduling `method` with
+// `value` on the event loop. A future that can't be given `value` is given the error
+// instead, so no waiter is left behind. Errors that can't be delivered are printed.
+static void resolve_flight(const std::string& key, PyObject* loop, const char* method,
+                           PyObject* value) {
+    for (PyObject* future : flight_finish(key)) {
+        if (!schedule_on_loop(loop, future, method, value)) {
+            PyObjectPtr exc_ty(nullptr), exc_val(nullptr), exc_tb(nullptr);
+            PyErr_Fetch(&exc_ty.ptr, &exc_val.ptr, &exc_tb.ptr);
+            PyErr_NormalizeException(&exc_ty.ptr, &exc_val.ptr, &exc_tb.ptr);
+            if (exc_val == nullptr ||
+                !schedule_on_loop(loop, future, "set_exception", exc_val.ptr)) {
+                PyErr_Print();
+            }
+        }
+        Py_DECREF(future);
+    }
+}
+
+// Paints the part of the document starting at `page_top` onto `surface`, which is
+// as wide as the document and as tall as the page. The device scale and offset of
+// `surface` pick the density and the rows it covers. Opaque RGB24 surfaces get a
+// white canvas first, new ARGB32 surfaces are already transparent.
+static void draw_page(const litehtml::document::ptr& doc, cairo_surface_t* surface,
+                      int page_top, cairo_surface_t* recording) {
+    cairo_t* cr = cairo_create(surface);
+    auto* container = static_cast<htmlkit_container*>(doc->container());
+    container->apply_quality(cr);
+    double x1, y1, x2, y2;
+    cairo_clip_extents(cr, &x1, &y1, &x2, &y2);
+
+    if (cairo_image_surface_get_format(surface) == CAIRO_FORMAT_RGB24) {
+        cairo_save(cr);
+        cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
+        cairo_paint(cr);
+        cairo_restore(cr);
+    }
+
+    if (recording != nullptr) {
+        // Replay the recorded draw pass instead of walking the document again
+        cairo_set_source_surface(cr, recording, 0, -page_top);
+        cairo_paint(cr);
+    } else {
+        // Draw document shifted up to the page, litehtml skips whatever misses the
+        // clip
+        int left = (int)std::floor(x1);
+        int top = (int)std::floor(y1);
+        litehtml::position clip(left, top, (int)std::ceil(x2) - left,
+                                (int)std::ceil(y2) - top);
+        doc->draw((litehtml::uint_ptr)cr, 0, -page_top, &clip);
+        container->end_text();
+    }
+
+    cairo_surface_flush(surface);
+    cairo_destroy(cr);
+}
+
+// Surface over `rows` rows of `surface` from row `top` on, in device pixels. It keeps
+// the device scale of `surface` and is offset so drawing lands on the same rows.
+static cairo_surface_t* band_surface(cairo_surface_t* surface, int top, int rows) {
+    cairo_surface_t* band = cairo_image_surface_create_for_data(
+        cairo_image_surface_get_data(surface) +
+            (size_t)top * cairo_image_surface_get_stride(surface),
+        cairo_image_surface_get_format(surface),
+        cairo_image_surface_get_width(surface), rows,
+        cairo_image_surface_get_stride(surface));
+    double x_scale, y_scale;
+    cairo_surface_get_device_scale(surface, &x_scale, &y_scale);
+    cairo_surface_set_device_scale(band, x_scale, y_scale);
+    cairo_surface_set_device_offset(band, 0, -top);
+    return band;
+}
+
+// Bands thinner than this are not worth a thread of their own
+static constexpr int min_band_height = 256;
+
+// Draws the page like `draw_page`, split into `bands` horizontal bands that are
+// painted concurrently. Every band is a surface over its rows of `surface`, drawn by
+// its own thread with its own font map and container draw state.
+static void draw_page_banded(const litehtml::document::ptr& doc,
+                             htmlkit_container& container, cairo_surface_t* surface,
+                             int page_top, int bands, cairo_surface_t* recording) {
+    int height = cairo_image_surface_get_height(surface);
+    bands = std::min(bands, height / min_band_height);
+    // A recording is replayed by one thread at a time
+    if (bands <= 1 || recording != nullptr) {
+        draw_page(doc, surface, page_top, recording);
+        return;
+    }
+    // Band threads must not wait on the event loop for images
+    container.process_images();
+
+    cairo_surface_flush(surface);
+    int band_height = (height + bands - 1) / bands;
+    auto draw_band = [&](int band_top) {
+        cairo_surface_t* band = band_surface(surface, band_top,
+                                             std::min(band_height, height - band_top));
+        draw_page(doc, band, page_top, nullptr);
+        cairo_surface_destroy(band);
+    };
+
+    std::vector<std::thread> workers;
+    for (int band_top = band_height; band_top < height; band_top += band_height) {
+        workers.emplace_back([&, band_top]() {
+            PangoFontMap* font_map =
+                pango_cairo_font_map_new_for_font_type(CAIRO_FONT_TYPE_FT);
+            pango_cairo_font_map_set_default(PANGO_CAIRO_FONT_MAP(font_map));
+            {
+                htmlkit_container::band_scope scope;
+                draw_band(band_top);
+            }
+            g_object_unref(font_map);
+        });
+    }
+    draw_band(0);
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    cairo_surface_mark_dirty(surface);
+}
+
+// Records the draw pass of the whole document, so it can be rasterized again
+// without layout, image fetches or container callbacks
+static cairo_surface_t* record_document(const litehtml::document::ptr& doc,
+                                        int width, int height) {
+    cairo_rectangle_t extents = {0, 0, (double)width, (double)height};
+    cairo_surface_t* recording =
+        cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, &extents);
+    cairo_t* cr = cairo_create(recording);
+    auto* container = static_cast<htmlkit_container*>(doc->container());
+    container->apply_quality(cr);
+    litehtml::position clip(0, 0, width, height);
+    doc->draw((litehtml::uint_ptr)cr, 0, 0, &clip);
+    container->end_text();
+    cairo_destroy(cr);
+    return recording;
+}
+
+// Recording kept for Python in a capsule. Replays are serialized, cairo doesn't
+// promise that replaying one recording from several threads at once is safe.
+struct recording_handle {
+    cairo_surface_t* surface;
+    int width;
+    int height;
+    bool transparent;
+    std::mutex mutex;
+};
+
+static constexpr const char* recording_capsule_name = "htmlkit.recording";
+
+static void recording_capsule_destructor(PyObject* capsule) {
+    auto* handle = static_cast<recording_handle*>(
+        PyCapsule_GetPointer(capsule, recording_capsule_name));
+    if (handle != nullptr) {
+        cairo_surface_destroy(handle->surface);
+        delete handle;
+    }
+}
+
+// Wraps a recording in a dict with its capsule and size, taking over `recording`.
+// The GIL must be held.
+static PyObject* recording_object(cairo_surface_t* recording, int width, int height,
+                                  bool transparent) {
+    auto* handle = new recording_handle{recording, width, height, transparent, {}};
+    PyObjectPtr capsule(
+        PyCapsule_New(handle, recording_capsule_name, recording_capsule_destructor));
+    if (capsule == nullptr) {
+        cairo_surface_destroy(recording);
+        delete handle;
+        return nullptr;
+    }
+    PyObject* result = PyDict_New();
+    if (result == nullptr) {
+        return nullptr;
+    }
+    PyObjectPtr width_obj(PyLong_FromLong(width));
+    PyObjectPtr height_obj(PyLong_FromLong(height));
+    if (width_obj == nullptr || height_obj == nullptr ||
+        PyDict_SetItemString(result, "handle", capsule.ptr) < 0 ||
+        PyDict_SetItemString(result, "width", width_obj.ptr) < 0 ||
+        PyDict_SetItemString(result, "height", height_obj.ptr) < 0) {
+        Py_DECREF(result);
+        return nullptr;
+    }
+    return result;
+}
+
+struct crop_box {
+    int x, y, width, height;
+};
+
+// Finds the part of a drawn page that differs from the canvas `draw_page` starts
+// from, white for RGB24 and transparent for ARGB32, grown by `padding` on every
+// side. A page that is all canvas is kept whole. Rows are compared in branchless
+// loops the compiler vectorizes, columns only while they are canvas on both ends.
+static crop_box content_box(cairo_surface_t* surface, int padding) {
+    cairo_surface_flush(surface);
+    const unsigned char* data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    // The top byte of RGB24 pixels is undefined
+    bool opaque = cairo_image_surface_get_format(surface) == CAIRO_FORMAT_RGB24;
+    uint32_t mask = opaque ? 0xFFFFFF : ~0u;
+    uint32_t background = opaque ? 0xFFFFFF : 0;
+    auto row = [&](int y) {
+        return reinterpret_cast<const uint32_t*>(data + (size_t)y * stride);
+    };
+    auto is_background = [&](uint32_t p) { return ((p ^ background) & mask) == 0; };
+    auto row_is_background = [&](int y) {
+        const uint32_t* pixels = row(y);
+        uint32_t diff = 0;
+        for (int x = 0; x < width; x++) {
+            diff |= pixels[x] ^ background;
+        }
+        return (diff & mask) == 0;
+    };
+
+    int top = 0;
+    while (top < height && row_is_background(top)) {
+        top++;
+    }
+    if (top == height) {
+        return {0, 0, width, height};
+    }
+    int bottom = height;
+    while (row_is_background(bottom - 1)) {
+        bottom--;
+    }
+    int left = width;
+    int right = 0;
+    for (int y = top; y < bottom; y++) {
+        const uint32_t* pixels = row(y);
+        int x = 0;
+        while (x < left && is_background(pixels[x])) {
+            x++;
+        }
+        left = x;
+        x = width;
+        while (x > right && is_background(pixels[x - 1])) {
+            x--;
+        }
+        right = x;
+    }
+    left = std::max(0, left - padding);
+    top = std::max(0, top - padding);
+    right = std::min(width, right + padding);
+    bottom = std::min(height, bottom + padding);
+    return {left, top, right - left, bottom - top};
+}
+
+// Output buffer that encoders write into through `write` and that ends up as the
+// bytes object of the result. With the full API the bytes object itself is the
+// buffer and is resized in place. The limited API can't resize bytes, so there the
+// data goes into a malloc'd buffer that `finish` copies once.
+class PyBytesSink {
+  public:
+    // The buffer is first allocated with `size_hint` bytes and grows past it
+    explicit PyBytesSink(size_t size_hint)
+        : m_size_hint(std::max<size_t>(size_hint, 4096)) {}
+
+    ~PyBytesSink() {
+#ifdef Py_LIMITED_API
+        free(m_data);
+#else
+        if (m_bytes != nullptr) {
+            GILState gil;
+            Py_DECREF(m_bytes);
+        }
+#endif
+    }
+
+    PyBytesSink(const PyBytesSink&) = delete;
+    PyBytesSink& operator=(const PyBytesSink&) = delete;
+
+    // A `cairo_write_func_t` with the sink as closure, can be called without the GIL
+    static cairo_status_t write(void* closure, const unsigned char* data,
+                                unsigned int length) {
+        auto* sink = static_cast<PyBytesSink*>(closure);
+        if (sink->m_size + length > sink->m_capacity && !sink->grow(length)) {
+            return CAIRO_STATUS_NO_MEMORY;
+        }
+        memcpy(sink->m_data + sink->m_size, data, length);
+        sink->m_size += length;
+        return CAIRO_STATUS_SUCCESS;
+    }
+
+    // Returns the written data as a new bytes object, the GIL must be held
+    PyObject* finish() {
+#ifdef Py_LIMITED_API
+        return PyBytes_FromStringAndSize(m_data, (Py_ssize_t)m_size);
+#else
+        if (m_bytes == nullptr) {
+            return PyBytes_FromStringAndSize(nullptr, 0);
+        }
+        // Shrinking only gives the unused tail back to the allocator
+        if (_PyBytes_Resize(&m_bytes, (Py_ssize_t)m_size) < 0) {
+            return nullptr;
+        }
+        return std::exchange(m_bytes, nullptr);
+#endif
+    }
+
+  private:
+    size_t m_size_hint;
+    char* m_data = nullptr;
+    size_t m_size = 0;
+    size_t m_capacity = 0;
+#ifndef Py_LIMITED_API
+    PyObject* m_bytes = nullptr;
+#endif
+
+    bool grow(size_t length) {
+        size_t capacity = std::max({m_size + length, m_capacity * 2, m_size_hint});
+#ifdef Py_LIMITED_API
+        char* data = static_cast<char*>(realloc(m_data, capacity));
+        if (data == nullptr) {
+            return false;
+        }
+        m_data = data;
+#else
+        GILState gil;
+        if (m_bytes == nullptr) {
+            m_bytes = PyBytes_FromStringAndSize(nullptr, (Py_ssize_t)capacity);
+        } else {
+            // Frees the object and clears `m_bytes` on failure
+            (void)_PyBytes_Resize(&m_bytes, (Py_ssize_t)capacity);
+        }
+        if (m_bytes == nullptr) {
+            PyErr_Clear();
+            m_data = nullptr;
+            m_size = m_capacity = 0;
+            return false;
+        }
+        m_data = PyBytes_AS_STRING(m_bytes);
+#endif
+        m_capacity = capacity;
+        return true;
+    }
+};
+
+// Guess of the encoded size of `surface`, text cards compress well
+static size_t encoded_size_hint(cairo_surface_t* surface) {
+    return (size_t)cairo_image_surface_get_stride(surface) *
+           cairo_image_surface_get_height(surface) / 16;
+}
+
+static cairo_wrapper::jpeg_options jpeg_options_of(const render_options& options) {
+    cairo_wrapper::jpeg_options jpeg;
+    jpeg.quality = options.jpeg_quality;
+    jpeg.subsampling = options.jpeg_subsampling;
+    jpeg.fast_dct = options.jpeg_fast_dct;
+    jpeg.optimize_coding = options.jpeg_optimize;
+    jpeg.progressive = options.jpeg_progressive;
+    jpeg.restart_rows = options.jpeg_restart_rows;
+    jpeg.grayscale = options.grayscale;
+    return jpeg;
+}
+
+// Rows drawn at a time before they are handed to the encoder thread
+static constexpr int stream_band_height = 64;
+
+// Draws the page like `draw_page` in bands of `stream_band_height` rows, while another
+// thread encodes the finished rows and passes them to `write_func`. Only PNG and JPEG
+// can be encoded row by row. Must be called without the GIL.
+static cairo_status_t draw_and_encode(const litehtml::document::ptr& doc,
+                                      cairo_surface_t* surface, int page_top,
+                                      const render_options& options,
+                                      cairo_write_func_t write_func, void* closure) {
+    int width = cairo_image_surface_get_width(surface);
+    int height = cairo_image_surface_get_height(surface);
+    cairo_format_t format = cairo_image_surface_get_format(surface);
+    std::unique_ptr<cairo_wrapper::row_encoder> encoder;
+    if (options.format == image_format::jpeg) {
+        encoder = std::make_unique<cairo_wrapper::jpeg_row_encoder>(
+            write_func, closure, width, height, format, jpeg_options_of(options));
+    } else {
+        encoder = std::make_unique<cairo_wrapper::png_row_encoder>(
+            write_func, closure, width, height, format, options.png_compression,
+            options.grayscale);
+    }
+
+    cairo_surface_flush(surface);
+    unsigned char* data = cairo_image_surface_get_data(surface);
+    int stride = cairo_image_surface_get_stride(surface);
+    std::mutex mutex;
+    std::condition_variable rows_cv;
+    int rows_ready = 0;
+    cairo_status_t status = CAIRO_STATUS_SUCCESS;
+    std::thread encode_thread([&]() {
+        int rows_done = 0;
+        while (rows_done < height) {
+            int rows_to;
+            {
+                std::unique_lock lock(mutex);
+                rows_cv.wait(lock, [&]() { return rows_ready > rows_done; });
+                rows_to = rows_ready;
+            }
+            // Rows above `rows_ready` are never touched by the drawing thread again
+            status = encoder->write_rows(data + (size_t)rows_done * stride, stride,
+                                         rows_to - rows_done);
+            if (status != CAIRO_STATUS_SUCCESS) {
+                return;
+            }
+            rows_done = rows_to;
+        }
+        status = encoder->finish();
+    });
+
+    for (int band_top = 0; band_top < height; band_top += stream_band_height) {
+        int band_rows = std::min(stream_band_height, height - band_top);
+        cairo_surface_t* band = band_surface(surface, band_top, band_rows);
+        draw_page(doc, band, page_top, nullptr);
+        cairo_surface_destroy(band);
+        {
+            std::lock_guard lock(mutex);
+            rows_ready = band_top + band_rows;
+        }
+        rows_cv.notify_one();
+    }
+    encode_thread.join();
+    cairo_surface_mark_dirty(surface);
+    return status;
+}
+
+// Wraps the pixels of a raw page in a dict, stealing the reference to `data`. The
+// GIL must be held.
+static PyObject* raw_page(PyObject* data, int width, int height, int stride,
+                          cairo_format_t format) {
+    PyObjectPtr data_obj(data);
+    PyObject* page = PyDict_New();
+    if (page == nullptr) {
+        return nullptr;
+    }
+    const char* format_name = format == CAIRO_FORMAT_ARGB32 ? "ARGB32" : "RGB24";
+    const std::pair<const char*, PyObject*> items[] = {
+        {"width", PyLong_FromLong(width)},
+        {"height", PyLong_FromLong(height)},
+        {"stride", PyLong_FromLong(stride)},
+        {"format", PyUnicode_FromString(format_name)},
+    };
+    bool ok = PyDict_SetItemString(page, "data", data_obj.ptr) == 0;
+    for (const auto& [key, value] : items) {
+        PyObjectPtr value_obj(value);
+        ok = ok && value != nullptr &&
+             PyDict_SetItemString(page, key, value_obj.ptr) == 0;
+    }
+    if (!ok) {
+        Py_DECREF(page);
+        return nullptr;
+    }
+    return page;
+}
+
+// Encodes `surface` to a new bytes object in the format of `options`. The GIL must
+// be held, it is released while encoding.
+static PyObject* encode_surface(cairo_surface_t* surface,
+                                const render_options& options) {
+    PyBytesSink sink(encoded_size_hint(surface));
+    cairo_status_t stat;
+    Py_BEGIN_ALLOW_THREADS;
+    switch (options.format) {
+    case image_format::jpeg:
+        stat = cairo_wrapper::cairo_surface_write_to_jpeg_stream(
+            surface, PyBytesSink::write, &sink, jpeg_options_of(options));
+        break;
+    case image_format::webp:
+        stat = cairo_wrapper::cairo_surface_write_to_webp_stream(
+            surface, PyBytesSink::write, &sink, options.webp_quality,
+            options.webp_lossless, options.webp_method);
+        break;
+    case image_format::avif:
+        stat = cairo_wrapper::cairo_surface_write_to_avif_stream(
+            surface, PyBytesSink::write, &sink, options.avif_quality,
+            options.avif_speed,
+            options.avif_threads > 0
+                ? options.avif_threads
+                : (int)std::max(1u, std::thread::hardware_concurrency()));
+        break;
+    default:
+        if (options.png_palette && !options.grayscale) {
+            stat = cairo_wrapper::cairo_surface_write_to_png_palette_stream(
+                surface, PyBytesSink::write, &sink, options.png_compression);
+        } else {
+            stat = cairo_wrapper::cairo_surface_write_to_png_stream_level(
+                surface, PyBytesSink::write, &sink, options.png_compression,
+                options.grayscale);
+        }
+        break;
+    }
+    Py_END_ALLOW_THREADS;
+
+    if (stat != CAIRO_STATUS_SUCCESS) {
+        PyErr_SetString(PyExc_RuntimeError, cairo_status_to_string(stat));
+        return nullptr;
+    }
+    return sink.finish();
+}
 
 extern "C" {
 static PyObject* render(PyObject* mod, PyObject* args) {
     PyObject *exception_fn = nullptr, *asyncio_run_coroutine_threadsafe = nullptr,
              *urljoin = nullptr, *asyncio_loop = nullptr, *img_fetch_fn = nullptr,
-             *css_fetch_fn = nullptr;
+             *css_fetch_fn = nullptr, *options_dict = nullptr;
     const char *font_name, *lang, *culture, *html_content, *base_url;
     float arg_dpi, arg_width, arg_height, default_font_size;
     int fast_data_scheme, allow_refit, debug_flag,
         image_flag; // image_flag: -1 for PNG, 0-100 for JPEG quality
     container_info info;
-    if (!PyArg_ParseTuple(args, "ssffffspissOOOOOOpp", &html_content, &base_url,
+    render_options options;
+    if (!PyArg_ParseTuple(args, "ssffffspissOOOOOOppO!", &html_content, &base_url,
                           &arg_dpi, &arg_width, &arg_height, &default_font_size,
                           &font_name, &allow_refit, &image_flag, &lang, &culture,
                           &exception_fn, &asyncio_run_coroutine_threadsafe, &urljoin,
                           &asyncio_loop, &img_fetch_fn, &css_fetch_fn,
-                          &fast_data_scheme, &debug_flag)) {
+                          &fast_data_scheme, &debug_flag, &PyDict_Type,
+                          &options_dict)) {
+        return nullptr;
+    }
+    // The image flag picks between PNG and JPEG, the options can ask for any format
+    options.format = image_flag == -1 ? image_format::png : image_format::jpeg;
+    options.jpeg_quality = image_flag;
+    if (!parse_render_options(options_dict, options)) {
+        return nullptr;
+    }
+    PyObjectPtr options_repr(PyObject_Repr(options_dict));
+    const char* options_key =
+        options_repr != nullptr ? PyUnicode_AsUTF8AndSize(options_repr.ptr, nullptr)
+                                : nullptr;
+    if (options_key == nullptr) {
         return nullptr;
     }
-    Py_INCREF(args);
     info.dpi = arg_dpi;
     info.width = arg_width;
     info.height = arg_height;
@@ -56,9 +601,25 @@ static PyObject* render(PyObject* mod, PyObject* args) {
     info.culture = std::string(culture);
     info.font_options = cairo_font_options_create();
     info.native_data_scheme = fast_data_scheme;
+    info.quality = options.quality;
     std::string html_content_str(html_content), base_url_str(base_url);
-    cairo_font_options_set_antialias(info.font_options, CAIRO_ANTIALIAS_DEFAULT);
-    cairo_font_options_set_hint_style(info.font_options, CAIRO_HINT_STYLE_NONE);
+    switch (info.quality) {
+    case render_quality::fast:
+        // Hinted glyphs on whole pixel metrics, grayscale coverage only
+        cairo_font_options_set_antialias(info.font_options, CAIRO_ANTIALIAS_GRAY);
+        cairo_font_options_set_hint_style(info.font_options, CAIRO_HINT_STYLE_SLIGHT);
+        cairo_font_options_set_hint_metrics(info.font_options, CAIRO_HINT_METRICS_ON);
+        break;
+    case render_quality::best:
+        cairo_font_options_set_antialias(info.font_options, CAIRO_ANTIALIAS_DEFAULT);
+        cairo_font_options_set_hint_style(info.font_options, CAIRO_HINT_STYLE_NONE);
+        cairo_font_options_set_hint_metrics(info.font_options, CAIRO_HINT_METRICS_OFF);
+        break;
+    default:
+        cairo_font_options_set_antialias(info.font_options, CAIRO_ANTIALIAS_DEFAULT);
+        cairo_font_options_set_hint_style(info.font_options, CAIRO_HINT_STYLE_NONE);
+        break;
+    }
     cairo_font_options_set_subpixel_order(info.font_options,
                                           CAIRO_SUBPIXEL_ORDER_DEFAULT);
 
@@ -73,6 +634,32 @@ static PyObject* render(PyObject* mod, PyObject* args) {
         return nullptr;
     }
 
+    // Identical requests against the same loop and fetchers share a single render
+    std::string flight_key;
+    for (const char* value : {html_content, base_url, font_name, lang, culture}) {
+        append_key(flight_key, value);
+    }
+    for (float value : {arg_dpi, arg_width, arg_height, default_font_size}) {
+        append_key(flight_key, value);
+    }
+    for (int value : {fast_data_scheme, allow_refit, debug_flag, image_flag}) {
+        append_key(flight_key, value);
+    }
+    for (PyObject* value : {exception_fn, asyncio_run_coroutine_threadsafe, urljoin,
+                            asyncio_loop, img_fetch_fn, css_fetch_fn}) {
+        append_key(flight_key, value);
+    }
+    append_key(flight_key, options_key);
+    // Raw pages are mutable bytearrays, so every caller gets a render of its own
+    if (options.format == image_format::raw) {
+        append_key(flight_key, future);
+    }
+    if (!flight_join(flight_key, future)) {
+        cairo_font_options_destroy(info.font_options);
+        return future;
+    }
+    Py_INCREF(args);
+
     std::thread([=]() {
         PangoFontMap* font_map =
             pango_cairo_font_map_new_for_font_type(CAIRO_FONT_TYPE_FT);
@@ -86,16 +673,7 @@ static PyObject* render(PyObject* mod, PyObject* args) {
             if (exc_tb != nullptr) {
                 PyException_SetTraceback(exc_val.ptr, exc_tb.ptr);
             }
-            PyObjectPtr set_exception(PyObject_GetAttrString(future, "set_exception"));
-            if (set_exception == nullptr) {
-                PyErr_Restore(exc_ty.ptr, exc_val.ptr, exc_tb.ptr);
-                PyErr_Print();
-            } else if (PyObject_CallMethod(asyncio_loop, "call_soon_threadsafe", "OO",
-                                           set_exception.ptr, exc_val.ptr) == nullptr) {
-                PyErr_Restore(exc_ty.ptr, exc_val.ptr, exc_tb.ptr);
-                PyErr_Print();
-            }
-            Py_DECREF(future);
+            resolve_flight(flight_key, asyncio_loop, "set_exception", exc_val.ptr);
             Py_DECREF(args);
             g_object_unref(font_map);
         };
@@ -109,7 +687,7 @@ static PyObject* render(PyObject* mod, PyObject* args) {
         container.m_css_fetch_fn = css_fetch_fn;
         auto doc = litehtml::document::createFromString(
             html_content_str, &container, litehtml::master_css,
-            " html { background-color: #fff; }");
+            options.transparent_background ? "" : " html { background-color: #fff; }");
         int width = arg_width;
         litehtml::pixel_t best_width = doc->render(arg_width);
         if (allow_refit && best_width < arg_width) {
@@ -117,6 +695,13 @@ static PyObject* render(PyObject* mod, PyObject* args) {
             doc->render(width);
         }
         int content_height = doc->content_height();
+        bool truncated = false;
+        if (options.max_height > 0 && content_height > options.max_height) {
+            // Elements below the cap are skipped by litehtml as they fall out of the
+            // clip passed to draw
+            content_height = options.max_height;
+            truncated = true;
+        }
         if (width < 1 || content_height < 1) {
             width = std::max(1, width);
             content_height = std::max(1, content_height);
@@ -124,116 +709,276 @@ static PyObject* render(PyObject* mod, PyObject* args) {
             PyErr_WarnEx(PyExc_RuntimeWarning,
                          "Resulting image has zero width or height", 1);
         }
-        cairo_surface_t* surface =
-            cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, content_height);
         cairo_surface_t* dbg_surface =
             debug_flag
                 ? cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, content_height)
                 : nullptr;
         container.set_debug_surface(dbg_surface);
-        if (!surface) {
-            GILState surface_creation_failed_gil;
-            PyErr_SetString(PyExc_RuntimeError, "Could not create surface");
-            return bail();
+
+        // In paged mode only one page sized surface is alive at a time
+        int page_height = content_height;
+        if (options.page_height > 0 && !debug_flag) {
+            page_height = std::min(options.page_height, content_height);
         }
-        if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
-            GILState surface_status_error_gil;
-            const char* err_msg = cairo_status_to_string(cairo_surface_status(surface));
-            PyErr_SetString(PyExc_RuntimeError, err_msg);
-            cairo_surface_destroy(surface);
+        // The debug layers are drawn onto a single surface, so they stay serial
+        int bands = options.draw_bands;
+        if (bands == 0) {
+            bands = (int)std::max(1u, std::thread::hardware_concurrency());
+        }
+        if (debug_flag) {
+            bands = 1;
+        }
+        // Streaming draws on this thread only, so the encoder thread keeps up with it.
+        // WebP, AVIF, palette PNG and auto crop need the whole picture at once.
+        bool stream_encode =
+            options.stream_encode && !debug_flag && !options.auto_crop &&
+            !options.keep_recording &&
+            ((options.format == image_format::png &&
+              (!options.png_palette || options.grayscale)) ||
+             options.format == image_format::jpeg);
+        // Pages are opaque unless asked otherwise, so the encoders can skip alpha
+        cairo_format_t page_format = options.transparent_background
+                                         ? CAIRO_FORMAT_ARGB32
+                                         : CAIRO_FORMAT_RGB24;
+        // Pages are painted from the recording when one is kept
+        cairo_surface_t* recording = nullptr;
+        if (options.keep_recording && !debug_flag) {
+            recording = record_document(doc, width, content_height);
+        }
+        PyObject* pages = nullptr;
+        auto bail_pages = [&]() {
+            {
+                GILState pages_gil;
+                Py_XDECREF(pages);
+            }
             cairo_surface_destroy(dbg_surface);
+            cairo_surface_destroy(recording);
             return bail();
+        };
+        {
+            GILState pages_gil;
+            pages = PyList_New(0);
         }
-        auto cr = cairo_create(surface);
-
-        // Fill background with white color
-        cairo_save(cr);
-        cairo_rectangle(cr, 0, 0, width, content_height);
-        cairo_set_source_rgba(cr, 1.0, 1.0, 1.0, 1.0);
-        cairo_fill(cr);
-        cairo_restore(cr);
-
-        // Draw document
-        litehtml::position clip(0, 0, width, content_height);
-
-        doc->draw((litehtml::uint_ptr)cr, 0, 0, &clip);
-
-        cairo_surface_flush(surface);
-        cairo_destroy(cr);
-
-        GILState gil;
-        PyObjectPtr bytes_obj(nullptr);
-        if (image_flag >= 0 && image_flag <= 100) {
-            unsigned char* jpeg_data = nullptr;
-            size_t jpeg_size = 0;
-            cairo_status_t stat;
-            Py_BEGIN_ALLOW_THREADS stat =
-                cairo_wrapper::cairo_surface_write_to_jpeg_mem(surface, &jpeg_data,
-                                                               &jpeg_size, image_flag);
-            cairo_surface_destroy(surface);
-            cairo_surface_destroy(dbg_surface);
-            Py_END_ALLOW_THREADS;
-
-            if (stat != CAIRO_STATUS_SUCCESS) {
-                const char* err_msg = cairo_status_to_string(stat);
+        if (pages == nullptr) {
+            return bail_pages();
+        }
+        // Pages are laid out in layout pixels and drawn at `scale` device pixels each
+        int pixel_width = (int)std::ceil(width * options.scale);
+        int crop_padding = (int)std::lround(options.auto_crop_padding * options.scale);
+        for (int page_top = 0; page_top < content_height; page_top += page_height) {
+            int height = (int)std::ceil(
+                std::min(page_height, content_height - page_top) * options.scale);
+            // Raw pages are drawn straight into the bytearray handed to Python
+            PyObject* raw_data = nullptr;
+            cairo_surface_t* surface;
+            if (options.format == image_format::raw) {
+                int stride = cairo_format_stride_for_width(page_format, pixel_width);
+                unsigned char* raw_pixels = nullptr;
+                {
+                    GILState raw_gil;
+                    raw_data = PyByteArray_FromStringAndSize(
+                        nullptr, (Py_ssize_t)stride * height);
+                    if (raw_data != nullptr) {
+                        raw_pixels = reinterpret_cast<unsigned char*>(
+                            PyByteArray_AsString(raw_data));
+                    }
+                }
+                if (raw_data == nullptr) {
+                    return bail_pages();
+                }
+                memset(raw_pixels, 0, (size_t)stride * height);
+                surface = cairo_image_surface_create_for_data(
+                    raw_pixels, page_format, pixel_width, height, stride);
+            } else {
+                surface = cairo_image_surface_create(page_format, pixel_width, height);
+            }
+            if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+                GILState surface_status_error_gil;
+                const char* err_msg =
+                    cairo_status_to_string(cairo_surface_status(surface));
                 PyErr_SetString(PyExc_RuntimeError, err_msg);
-                return bail();
+                cairo_surface_destroy(surface);
+                Py_XDECREF(raw_data);
+                return bail_pages();
+            }
+            cairo_surface_set_device_scale(surface, options.scale, options.scale);
+            bool appended;
+            if (raw_data != nullptr) {
+                draw_page_banded(doc, container, surface, page_top, bands, recording);
+                int stride = cairo_image_surface_get_stride(surface);
+                crop_box box = {0, 0, pixel_width, height};
+                if (options.auto_crop) {
+                    box = content_box(surface, crop_padding);
+                    // Move the kept rows to the front, the bytearray is cut after
+                    unsigned char* pixels = cairo_image_surface_get_data(surface);
+                    for (int y = 0; y < box.height; y++) {
+                        memmove(pixels + (size_t)y * stride,
+                                pixels + (size_t)(box.y + y) * stride + box.x * 4,
+                                (size_t)box.width * 4);
+                    }
+                }
+                // Drop the surface first, the bytearray is freed if wrapping it fails
+                cairo_surface_destroy(surface);
+                surface = nullptr;
+                GILState page_gil;
+                if (box.height != height &&
+                    PyByteArray_Resize(raw_data, (Py_ssize_t)stride * box.height) < 0) {
+                    Py_DECREF(raw_data);
+                    raw_data = nullptr;
+                }
+                PyObjectPtr page(raw_data == nullptr
+                                     ? nullptr
+                                     : raw_page(raw_data, box.width, box.height,
+                                                stride, page_format));
+                appended = page != nullptr && PyList_Append(pages, page.ptr) == 0;
+            } else if (stream_encode) {
+                PyBytesSink sink(encoded_size_hint(surface));
+                cairo_status_t stat = draw_and_encode(doc, surface, page_top, options,
+                                                      PyBytesSink::write, &sink);
+                GILState page_gil;
+                if (stat != CAIRO_STATUS_SUCCESS) {
+                    PyErr_SetString(PyExc_RuntimeError, cairo_status_to_string(stat));
+                    appended = false;
+                } else {
+                    PyObjectPtr page(sink.finish());
+                    appended = page != nullptr && PyList_Append(pages, page.ptr) == 0;
+                }
+            } else {
+                draw_page_banded(doc, container, surface, page_top, bands, recording);
+                // The cropped page is a view into the rows of the drawn one
+                cairo_surface_t* output = surface;
+                if (options.auto_crop) {
+                    crop_box box = content_box(surface, crop_padding);
+                    int stride = cairo_image_surface_get_stride(surface);
+                    output = cairo_image_surface_create_for_data(
+                        cairo_image_surface_get_data(surface) +
+                            (size_t)box.y * stride + box.x * 4,
+                        page_format, box.width, box.height, stride);
+                }
+                GILState page_gil;
+                PyObjectPtr page(encode_surface(output, options));
+                appended = page != nullptr && PyList_Append(pages, page.ptr) == 0;
+                if (output != surface) {
+                    cairo_surface_destroy(output);
+                }
             }
-            bytes_obj.ptr = PyBytes_FromStringAndSize(
-                reinterpret_cast<const char*>(jpeg_data), jpeg_size);
-            free(jpeg_data);
-        } else {
-            std::vector<unsigned char> bytes;
-            cairo_status_t stat;
-            Py_BEGIN_ALLOW_THREADS stat = cairo_surface_write_to_png_stream(
-                surface, cairo_wrapper::write_to_vector, &bytes);
             cairo_surface_destroy(surface);
-            cairo_surface_destroy(dbg_surface);
-            Py_END_ALLOW_THREADS;
+            if (!appended) {
+                return bail_pages();
+            }
+        }
 
-            if (stat != CAIRO_STATUS_SUCCESS) {
-                const char* err_msg = cairo_status_to_string(stat);
-                PyErr_SetString(PyExc_RuntimeError, err_msg);
+        std::string debug_html;
+        if (debug_flag) {
+            debug_html = container.export_debug_layers();
+        }
+        cairo_surface_destroy(dbg_surface);
+
+        GILState gil;
+        PyObjectPtr pages_obj(pages);
+        PyObjectPtr recording_obj(nullptr);
+        if (recording != nullptr) {
+            recording_obj.ptr = recording_object(recording, width, content_height,
+                                                 options.transparent_background);
+            if (recording_obj == nullptr) {
                 return bail();
             }
-            bytes_obj.ptr = PyBytes_FromStringAndSize(
-                reinterpret_cast<const char*>(bytes.data()), bytes.size());
         }
-
-        if (bytes_obj == nullptr) {
+        PyObjectPtr result_obj(PyDict_New());
+        if (result_obj == nullptr ||
+            PyDict_SetItemString(result_obj.ptr, "image", PyList_GetItem(pages, 0)) <
+                0 ||
+            PyDict_SetItemString(result_obj.ptr, "pages", pages) < 0 ||
+            PyDict_SetItemString(result_obj.ptr, "truncated",
+                                 truncated ? Py_True : Py_False) < 0) {
             return bail();
         }
-        PyObjectPtr set_result(PyObject_GetAttrString(future, "set_result"));
-        if (set_result == nullptr) {
+        PyObjectPtr culled_obj(PyLong_FromUnsignedLongLong(container.culled_draws()));
+        if (culled_obj == nullptr ||
+            PyDict_SetItemString(result_obj.ptr, "culled_draws", culled_obj.ptr) < 0) {
+            return bail();
+        }
+        if (recording_obj != nullptr &&
+            PyDict_SetItemString(result_obj.ptr, "recording", recording_obj.ptr) < 0) {
             return bail();
         }
-
-        PyObjectPtr result_obj(nullptr);
         if (debug_flag) {
-            std::string debug_html = container.export_debug_layers();
             PyObjectPtr html_obj(
                 PyUnicode_FromStringAndSize(debug_html.c_str(), debug_html.size()));
-            if (html_obj == nullptr) {
+            if (html_obj == nullptr ||
+                PyDict_SetItemString(result_obj.ptr, "debug_html", html_obj.ptr) <
+                    0) {
                 return bail();
             }
-            result_obj.ptr = PyTuple_Pack(2, bytes_obj.ptr, html_obj.ptr);
-        } else {
-            Py_INCREF(bytes_obj.ptr);
-            result_obj = bytes_obj;
-        }
-        PyObjectPtr call_soon_result(
-            PyObject_CallMethod(asyncio_loop, "call_soon_threadsafe", "OO",
-                                set_result.ptr, result_obj.ptr));
-        if (call_soon_result == nullptr) {
-            return bail();
         }
-        Py_DECREF(future);
+        // Every waiter is resolved here, `bail` would find the flight already gone
+        resolve_flight(flight_key, asyncio_loop, "set_result", result_obj.ptr);
         Py_DECREF(args);
         g_object_unref(font_map);
     }).detach();
     return future;
 }
 
+// Rasterizes the part of a recording at (x, y) of size (w, h), scaled by `scale`,
+// and encodes it like the pages of `render`.
+static PyObject* rasterize(PyObject* mod, PyObject* args) {
+    PyObject *capsule = nullptr, *options_dict = nullptr;
+    double scale, x, y, w, h;
+    int jpeg_quality;
+    if (!PyArg_ParseTuple(args, "OdddddiO!", &capsule, &scale, &x, &y, &w, &h,
+                          &jpeg_quality, &PyDict_Type, &options_dict)) {
+        return nullptr;
+    }
+    auto* handle = static_cast<recording_handle*>(
+        PyCapsule_GetPointer(capsule, recording_capsule_name));
+    if (handle == nullptr) {
+        return nullptr;
+    }
+    render_options options;
+    options.jpeg_quality = jpeg_quality;
+    if (!parse_render_options(options_dict, options)) {
+        return nullptr;
+    }
+    if (options.format == image_format::raw) {
+        PyErr_SetString(PyExc_ValueError, "raw output can't be rasterized");
+        return nullptr;
+    }
+    if (handle->transparent && options.format == image_format::jpeg) {
+        PyErr_SetString(PyExc_ValueError, "jpeg can't keep a transparent background");
+        return nullptr;
+    }
+    if (!(scale > 0) || !(w > 0) || !(h > 0)) {
+        PyErr_SetString(PyExc_ValueError, "scale and crop size must be positive");
+        return nullptr;
+    }
+    cairo_surface_t* surface = cairo_image_surface_create(
+        handle->transparent ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24,
+        (int)std::ceil(w * scale), (int)std::ceil(h * scale));
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        cairo_status_to_string(cairo_surface_status(surface)));
+        cairo_surface_destroy(surface);
+        return nullptr;
+    }
+    Py_BEGIN_ALLOW_THREADS;
+    {
+        std::lock_guard lock(handle->mutex);
+        cairo_t* cr = cairo_create(surface);
+        if (!handle->transparent) {
+            cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
+            cairo_paint(cr);
+        }
+        cairo_scale(cr, scale, scale);
+        cairo_set_source_surface(cr, handle->surface, -x, -y);
+        cairo_paint(cr);
+        cairo_destroy(cr);
+    }
+    Py_END_ALLOW_THREADS;
+    PyObject* result = encode_surface(surface, options);
+    cairo_surface_destroy(surface);
+    return result;
+}
+
 static PyObject* setup_fontconfig(PyObject* mod, PyObject* args) {
     init_fontconfig();
     Py_RETURN_NONE;
@@ -244,6 +989,10 @@ static PyMethodDef methods[] = {
      /*.ml_meth = */ render,
      /*.ml_flags = */ METH_VARARGS,
      /*.ml_doc = */ "Core function for rendering HTML page."},
+    {/* .ml_name = */ "_rasterize_internal",
+     /*.ml_meth = */ rasterize,
+     /*.ml_flags = */ METH_VARARGS,
+     /*.ml_doc = */ "Rasterize a recording kept by a render."},
     {/* .ml_name = */ "_init_fontconfig_internal",
      /*.ml_meth = */ setup_fontconfig,
      /*.ml_flags = */ METH_VARARGS,
@@ -21,6 +21,7 @@ License along with this library; if not, see <https://www.gnu.org/licenses/>.
 #include <chrono>
 #include <condition_variable>
 #include <mutex>
+#include <unordered_map>
 
 extern "C" {
 PyObject* invoke_waiter(PyObject* self, PyObject* args) {
@@ -102,3 +103,25 @@ PyObject* waiter_wait(PyWaiter* waiter) {
         return nullptr;
     }
 }
+
+static std::mutex flights_mutex;
+static std::unordered_map<std::string, std::vector<PyObject*>> flights;
+
+bool flight_join(const std::string& key, PyObject* py_future) {
+    std::lock_guard lock(flights_mutex);
+    auto [it, inserted] = flights.try_emplace(key);
+    Py_INCREF(py_future);
+    it->second.push_back(py_future);
+    return inserted;
+}
+
+std::vector<PyObject*> flight_finish(const std::string& key) {
+    std::lock_guard lock(flights_mutex);
+    auto it = flights.find(key);
+    if (it == flights.end()) {
+        return {};
+    }
+    std::vector<PyObject*> futures = std::move(it->second);
+    flights.erase(it);
+    return futures;
+}
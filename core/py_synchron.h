@@ -23,6 +23,7 @@ License along with this library; if not, see <https://www.gnu.org/licenses/>.
 #include <memory>
 #include <mutex>
 #include <string>
+#include <vector>
 
 class GILState {
   public:
@@ -75,4 +76,12 @@ struct PyWaiter {
 bool attach_waiter(PyObject* py_future, PyWaiter* waiter);
 PyObject* waiter_wait(PyWaiter* waiter);
 
+// Single-flight registry of in-flight renders, keyed by their serialized inputs.
+// `flight_join` takes a new reference to `py_future` and returns true if the caller
+// is the first one for `key` and therefore has to do the actual work.
+// `flight_finish` removes the key and hands all joined futures (owned references)
+// back to the leader, so that every one of them gets resolved with the same result.
+bool flight_join(const std::string& key, PyObject* py_future);
+std::vector<PyObject*> flight_finish(const std::string& key);
+
 #endif // PY_SYNCHRON_H
@@ -0,0 +1,216 @@
+/*
+Copyright (C) 2025 NoneBot
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "render_options.h"
+
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <utility>
+
+static bool get_int(PyObject* dict, const char* key, int& out) {
+    PyObject* value = PyDict_GetItemString(dict, key); // borrowed
+    if (value == nullptr) {
+        return true;
+    }
+    long result = PyLong_AsLong(value);
+    if (result == -1 && PyErr_Occurred()) {
+        return false;
+    }
+    if (result < INT_MIN || result > INT_MAX) {
+        PyErr_Format(PyExc_OverflowError, "%s is out of range", key);
+        return false;
+    }
+    out = static_cast<int>(result);
+    return true;
+}
+
+static bool get_double(PyObject* dict, const char* key, double& out) {
+    PyObject* value = PyDict_GetItemString(dict, key); // borrowed
+    if (value == nullptr) {
+        return true;
+    }
+    double result = PyFloat_AsDouble(value);
+    if (result == -1.0 && PyErr_Occurred()) {
+        return false;
+    }
+    out = result;
+    return true;
+}
+
+static bool get_bool(PyObject* dict, const char* key, bool& out) {
+    PyObject* value = PyDict_GetItemString(dict, key); // borrowed
+    if (value == nullptr) {
+        return true;
+    }
+    int result = PyObject_IsTrue(value);
+    if (result < 0) {
+        return false;
+    }
+    out = result != 0;
+    return true;
+}
+
+static bool get_format(PyObject* dict, const char* key, image_format& out) {
+    PyObject* value = PyDict_GetItemString(dict, key); // borrowed
+    if (value == nullptr) {
+        return true;
+    }
+    const char* name = PyUnicode_AsUTF8AndSize(value, nullptr);
+    if (name == nullptr) {
+        return false;
+    }
+    static const std::pair<const char*, image_format> formats[] = {
+        {"png", image_format::png},
+        {"jpeg", image_format::jpeg},
+        {"webp", image_format::webp},
+        {"avif", image_format::avif},
+        {"raw", image_format::raw},
+    };
+    for (const auto& [format_name, format] : formats) {
+        if (strcmp(name, format_name) == 0) {
+            out = format;
+            return true;
+        }
+    }
+    PyErr_Format(PyExc_ValueError, "unsupported image format: %s", name);
+    return false;
+}
+
+static bool get_quality(PyObject* dict, const char* key, render_quality& out) {
+    PyObject* value = PyDict_GetItemString(dict, key); // borrowed
+    if (value == nullptr) {
+        return true;
+    }
+    const char* name = PyUnicode_AsUTF8AndSize(value, nullptr);
+    if (name == nullptr) {
+        return false;
+    }
+    static const std::pair<const char*, render_quality> qualities[] = {
+        {"fast", render_quality::fast},
+        {"normal", render_quality::normal},
+        {"best", render_quality::best},
+    };
+    for (const auto& [quality_name, quality] : qualities) {
+        if (strcmp(name, quality_name) == 0) {
+            out = quality;
+            return true;
+        }
+    }
+    PyErr_Format(PyExc_ValueError, "unsupported quality: %s", name);
+    return false;
+}
+
+bool parse_render_options(PyObject* dict, render_options& options) {
+    if (!get_int(dict, "max_height", options.max_height) ||
+        !get_int(dict, "page_height", options.page_height) ||
+        !get_int(dict, "draw_bands", options.draw_bands) ||
+        !get_bool(dict, "stream_encode", options.stream_encode) ||
+        !get_bool(dict, "transparent_background", options.transparent_background) ||
+        !get_bool(dict, "auto_crop", options.auto_crop) ||
+        !get_int(dict, "auto_crop_padding", options.auto_crop_padding) ||
+        !get_bool(dict, "keep_recording", options.keep_recording) ||
+        !get_double(dict, "scale", options.scale) ||
+        !get_quality(dict, "quality", options.quality) ||
+        !get_format(dict, "image_format", options.format) ||
+        !get_bool(dict, "grayscale", options.grayscale) ||
+        !get_int(dict, "png_compression", options.png_compression) ||
+        !get_bool(dict, "png_palette", options.png_palette) ||
+        !get_int(dict, "jpeg_subsampling", options.jpeg_subsampling) ||
+        !get_bool(dict, "jpeg_fast_dct", options.jpeg_fast_dct) ||
+        !get_bool(dict, "jpeg_optimize", options.jpeg_optimize) ||
+        !get_bool(dict, "jpeg_progressive", options.jpeg_progressive) ||
+        !get_int(dict, "jpeg_restart_rows", options.jpeg_restart_rows) ||
+        !get_int(dict, "webp_quality", options.webp_quality) ||
+        !get_bool(dict, "webp_lossless", options.webp_lossless) ||
+        !get_int(dict, "webp_method", options.webp_method) ||
+        !get_int(dict, "avif_quality", options.avif_quality) ||
+        !get_int(dict, "avif_speed", options.avif_speed) ||
+        !get_int(dict, "avif_threads", options.avif_threads)) {
+        return false;
+    }
+    if (options.max_height < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_height must not be negative");
+        return false;
+    }
+    if (options.page_height < 0) {
+        PyErr_SetString(PyExc_ValueError, "page_height must not be negative");
+        return false;
+    }
+    if (options.draw_bands < 0) {
+        PyErr_SetString(PyExc_ValueError, "draw_bands must not be negative");
+        return false;
+    }
+    if (!(options.scale > 0) || !std::isfinite(options.scale)) {
+        PyErr_SetString(PyExc_ValueError, "scale must be positive");
+        return false;
+    }
+    if (options.auto_crop && options.page_height > 0) {
+        // Pages cropped one by one would no longer line up into the document
+        PyErr_SetString(PyExc_ValueError, "auto_crop can't be used with page_height");
+        return false;
+    }
+    if (options.auto_crop_padding < 0) {
+        PyErr_SetString(PyExc_ValueError, "auto_crop_padding must not be negative");
+        return false;
+    }
+    if (options.grayscale && options.format != image_format::png &&
+        options.format != image_format::jpeg) {
+        PyErr_SetString(PyExc_ValueError, "grayscale requires png or jpeg output");
+        return false;
+    }
+    if (options.transparent_background && options.format == image_format::jpeg) {
+        // Premultiplied transparent pixels would come out black
+        PyErr_SetString(PyExc_ValueError, "jpeg can't keep a transparent background");
+        return false;
+    }
+    if (options.png_compression < 0 || options.png_compression > 9) {
+        PyErr_SetString(PyExc_ValueError, "png_compression must be between 0 and 9");
+        return false;
+    }
+    if (options.jpeg_subsampling != 444 && options.jpeg_subsampling != 422 &&
+        options.jpeg_subsampling != 420) {
+        PyErr_SetString(PyExc_ValueError, "jpeg_subsampling must be 444, 422 or 420");
+        return false;
+    }
+    if (options.jpeg_restart_rows < 0 || options.jpeg_restart_rows > 65535) {
+        PyErr_SetString(PyExc_ValueError,
+                        "jpeg_restart_rows must be between 0 and 65535");
+        return false;
+    }
+    if (options.webp_quality < 0 || options.webp_quality > 100) {
+        PyErr_SetString(PyExc_ValueError, "webp_quality must be between 0 and 100");
+        return false;
+    }
+    if (options.webp_method < 0 || options.webp_method > 6) {
+        PyErr_SetString(PyExc_ValueError, "webp_method must be between 0 and 6");
+        return false;
+    }
+    if (options.avif_quality < 0 || options.avif_quality > 100) {
+        PyErr_SetString(PyExc_ValueError, "avif_quality must be between 0 and 100");
+        return false;
+    }
+    if (options.avif_speed < 0 || options.avif_speed > 10) {
+        PyErr_SetString(PyExc_ValueError, "avif_speed must be between 0 and 10");
+        return false;
+    }
+    if (options.avif_threads < 0) {
+        PyErr_SetString(PyExc_ValueError, "avif_threads must not be negative");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,94 @@
+/*
+Copyright (C) 2025 NoneBot
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef RENDER_OPTIONS_H
+#define RENDER_OPTIONS_H
+
+#include <Python.h>
+
+#include "container_info.h"
+
+// `raw` hands out the cairo pixel buffer itself instead of encoding it
+enum class image_format { png, jpeg, webp, avif, raw };
+
+// Output side options of a render, parsed from the options dict passed to
+// `_render_internal`. Layout side options live in `container_info`.
+struct render_options {
+    // Maximum height of the output in pixels, 0 for unlimited
+    int max_height = 0;
+    // Height of each page in pixels when the output is split into pages, 0 for a
+    // single image
+    int page_height = 0;
+    // Number of horizontal bands each page is drawn in concurrently, 0 to use one
+    // per hardware thread
+    int draw_bands = 1;
+    // Encode the rows of each page while the rows below are still being drawn,
+    // replaces drawing in bands
+    bool stream_encode = false;
+    // Keep the alpha channel and leave the page transparent where nothing is drawn,
+    // instead of drawing onto an opaque white RGB canvas
+    bool transparent_background = false;
+    // Crop each page to what differs from the background before encoding, keeping
+    // `auto_crop_padding` pixels of background around it
+    bool auto_crop = false;
+    int auto_crop_padding = 0;
+    // Record the draw pass, paint the pages from the recording and hand it out for
+    // rasterizing again later
+    bool keep_recording = false;
+    // Device pixels per layout pixel of the output, the document is laid out at its
+    // logical size and drawn at this density
+    double scale = 1.0;
+    // Drawing preset, handed to the container through `container_info` as it changes
+    // text metrics and so the layout
+    render_quality quality = render_quality::normal;
+    // Encoding of the output, set from the image flag before the dict is parsed
+    image_format format = image_format::png;
+    // Encode PNG or JPEG output as 8-bit luminance, takes precedence over
+    // `png_palette`
+    bool grayscale = false;
+    // zlib level of PNG output, 0 (fastest) to 9 (smallest)
+    int png_compression = 6;
+    // Write PNG output as 8-bit palette image, quantized if it has more than 256
+    // colors
+    bool png_palette = false;
+    // Quality of JPEG output, 0-100
+    int jpeg_quality = 100;
+    // Chroma subsampling of JPEG output, 444, 422 or 420
+    int jpeg_subsampling = 420;
+    bool jpeg_fast_dct = false;
+    bool jpeg_optimize = false;
+    bool jpeg_progressive = false;
+    // Restart marker every this many MCU rows of JPEG output, 0 for none
+    int jpeg_restart_rows = 0;
+    // Quality of lossy WebP output, for lossless output how hard to compress, 0-100
+    int webp_quality = 80;
+    bool webp_lossless = false;
+    // WebP compression method, 0 (fastest) to 6 (smallest)
+    int webp_method = 4;
+    // Quality of AVIF output, 0-100
+    int avif_quality = 60;
+    // AVIF encoder speed, 0 (smallest) to 10 (fastest)
+    int avif_speed = 6;
+    // Number of AVIF encoder threads, 0 to use one per hardware thread
+    int avif_threads = 1;
+};
+
+// Fills `options` from a dict, keys that are missing keep their defaults.
+// Returns false with a Python exception set on invalid values.
+bool parse_render_options(PyObject* dict, render_options& options);
+
+#endif // RENDER_OPTIONS_H
@@ -1,6 +1,7 @@
-from asyncio import get_running_loop, run_coroutine_threadsafe
+from asyncio import get_running_loop, run_coroutine_threadsafe, to_thread
 import base64
 from collections.abc import Callable, Coroutine, Mapping, Sequence
+from dataclasses import dataclass, field
 import os
 from pathlib import Path
 from typing import Any, Literal
@@ -188,39 +189,217 @@ async def combined_css_fetcher(url: str) -> str | None:
     return await network_css_fetcher(url)
 
 
-async def html_to_pic(
+@dataclass
+class RawImage:
+    """未编码的原始像素, 通过 `data` 零拷贝访问
+
+    Python 3.12 起 (PEP 688) 也可直接对本对象使用缓冲区协议, 如 `memoryview(image)`,
+    更早的版本请使用 `memoryview(image.data)`
+    """
+
+    data: bytearray
+    """像素数据, 每像素 4 字节, 按本机字节序存储, 颜色已预乘 alpha"""
+    width: int
+    """宽度"""
+    height: int
+    """高度"""
+    stride: int
+    """每行字节数"""
+    format: Literal["ARGB32", "RGB24"]
+    """像素格式, RGB24 时每像素的最高字节未使用"""
+
+    def __buffer__(self, flags: int, /) -> memoryview:
+        return memoryview(self.data)
+
+
+def _page_image(page: bytes | Mapping[str, Any]) -> "bytes | RawImage":
+    if isinstance(page, bytes):
+        return page
+    return RawImage(
+        data=page["data"],
+        width=page["width"],
+        height=page["height"],
+        stride=page["stride"],
+        format=page["format"],
+    )
+
+
+class Recording:
+    """渲染时保留的绘制记录, 可在不重新排版的情况下再次栅格化"""
+
+    def __init__(self, handle: Any, width: int, height: int) -> None:
+        self._handle = handle
+        self.width = width
+        """记录的宽度"""
+        self.height = height
+        """记录的高度, 为完整内容的高度"""
+
+    async def rasterize(
+        self,
+        *,
+        scale: float = 1.0,
+        crop: tuple[float, float, float, float] | None = None,
+        image_format: Literal["png", "jpeg", "webp", "avif"] = "png",
+        jpeg_quality: int = 100,
+        png_compression: int = 6,
+        webp_quality: int = 80,
+        webp_lossless: bool = False,
+        avif_quality: int = 60,
+        grayscale: bool = False,
+    ) -> bytes:
+        """
+        将绘制记录栅格化为图片。
+
+        Args:
+            scale (float, optional): 缩放比例
+            crop (tuple[float, float, float, float], optional): 栅格化的区域,
+                为缩放前的 (x, y, 宽, 高), 默认为整个记录
+            image_format ("png" | "jpeg" | "webp" | "avif", optional): 图片格式
+            jpeg_quality (int, optional): jpeg图片质量, 1-100
+            png_compression (int, optional): png 压缩等级, 0-9
+            webp_quality (int, optional): webp 图片质量, 1-100
+            webp_lossless (bool, optional): 是否使用无损 webp
+            avif_quality (int, optional): avif 图片质量, 0-100
+            grayscale (bool, optional): 是否输出 8 位灰度图, 仅支持 png 和 jpeg
+
+        Returns:
+            bytes: 图片字节
+        """
+        x, y, width, height = crop or (0.0, 0.0, self.width, self.height)
+        return await to_thread(
+            core._rasterize_internal,  # pyright: ignore[reportPrivateUsage]
+            self._handle,
+            scale,
+            x,
+            y,
+            width,
+            height,
+            jpeg_quality,
+            {
+                "image_format": image_format,
+                "png_compression": png_compression,
+                "webp_quality": webp_quality,
+                "webp_lossless": webp_lossless,
+                "avif_quality": avif_quality,
+                "grayscale": grayscale,
+            },
+        )
+
+
+@dataclass
+class RenderResult:
+    """渲染结果"""
+
+    image: bytes | RawImage
+    """渲染后的图片字节, 分页时为第一页, `image_format` 为 "raw" 时为原始像素"""
+    pages: list[bytes | RawImage] = field(default_factory=list)
+    """按 `page_height` 分页渲染的各页图片字节"""
+    truncated: bool = False
+    """图片是否因 `max_height` 被截断"""
+    culled_draws: int = 0
+    """因完全位于裁剪区域外而跳过的绘制调用数
+
+    为所有绘制遍次的累计值: 每页、每个分带及流式编码的每个分段都会完整遍历一次文档,
+    同一元素可能被计入多次, 因此该值随 `page_height`、`draw_bands` 与
+    `stream_encode` 而变化
+    """
+    recording: Recording | None = None
+    """`keep_recording` 启用时保留的绘制记录"""
+
+
+def _log_render_exception(
+    exc_type: type[BaseException], exc_value: BaseException, exc_traceback: Any
+) -> None:
+    # 模块级函数, 使相同的渲染请求共享同一次渲染
+    nonebot.logger.opt(exception=(exc_type, exc_value, exc_traceback)).error(
+        "Exception in html_to_pic: "
+    )
+
+
+async def render_html(
     html: str,
     *,
     base_url: str = "",
     dpi: float = 96.0,
+    scale: float = 1.0,
+    quality: Literal["fast", "normal", "best"] = "normal",
     max_width: float = 800.0,
     device_height: float = 600.0,
     default_font_size: float = 12.0,
     font_name: str = "sans-serif",
     allow_refit: bool = True,
-    image_format: Literal["png", "jpeg"] = "png",
+    image_format: Literal["png", "jpeg", "webp", "avif", "raw"] = "png",
     jpeg_quality: int = 100,
+    jpeg_subsampling: Literal[444, 422, 420] = 420,
+    jpeg_fast_dct: bool = False,
+    jpeg_optimize: bool = False,
+    jpeg_progressive: bool = False,
+    jpeg_restart_rows: int = 0,
+    png_compression: int = 6,
+    png_palette: bool = False,
+    webp_quality: int = 80,
+    webp_lossless: bool = False,
+    webp_method: int = 4,
+    avif_quality: int = 60,
+    avif_speed: int = 6,
+    avif_threads: int = 1,
+    max_height: int = 0,
+    page_height: int = 0,
+    draw_bands: int = 1,
+    stream_encode: bool = False,
+    transparent_background: bool = False,
+    grayscale: bool = False,
+    auto_crop: bool = False,
+    auto_crop_padding: int = 0,
+    keep_recording: bool = False,
     lang: str = "zh",
     culture: str = "CN",
     img_fetch_fn: ImgFetchFn = combined_img_fetcher,
     css_fetch_fn: CSSFetchFn = combined_css_fetcher,
     native_data_scheme: bool = True,
     urljoin_fn: Callable[[str, str], str] = urljoin,
-) -> bytes:
+) -> RenderResult:
     """
-    将 HTML 渲染为图片。
+    将 HTML 渲染为图片，并返回包含额外信息的渲染结果。
 
     Args:
         html (str): HTML 内容
         base_url (str, optional): 基础路径
         dpi (float, optional): DPI
+        scale (float, optional): 像素密度倍数, 按原尺寸排版后以此倍数绘制, 不影响换行
+        quality ("fast" | "normal" | "best", optional): 绘制质量, "fast" 更快,
+            "best" 抗锯齿与图片缩放更精细, 字形按亚像素定位
         max_width (float, optional): 最大宽度
         device_height (float, optional): 设备高度
         default_font_size (float, optional): 默认字体大小
         font_name (str, optional): 字体名称
         allow_refit (bool, optional): 允许根据内容缩小宽度
-        image_format ("png" | "jpeg", optional): 图片格式
+        image_format ("png" | "jpeg" | "webp" | "avif" | "raw", optional): 图片格式,
+            "raw" 为不编码, 直接返回原始像素
         jpeg_quality (int, optional): jpeg图片质量, 1-100
+        jpeg_subsampling (444 | 422 | 420, optional): 色度抽样, 444 更清晰, 420 更小
+        jpeg_fast_dct (bool, optional): jpeg 是否使用更快但略不精确的 DCT
+        jpeg_optimize (bool, optional): jpeg 是否优化 Huffman 表, 图片更小但更慢
+        jpeg_progressive (bool, optional): 是否输出渐进式 jpeg
+        jpeg_restart_rows (int, optional): jpeg 每隔多少行 MCU 插入重启标记, 0 为不插入
+        png_compression (int, optional): png 压缩等级, 0-9, 越大图片越小但越慢
+        png_palette (bool, optional): 是否输出 8 位调色板 png, 超过 256 色时会量化
+        webp_quality (int, optional): webp 图片质量, 1-100, 无损模式下为压缩力度
+        webp_lossless (bool, optional): 是否使用无损 webp
+        webp_method (int, optional): webp 压缩方法, 0-6, 越大图片越小但越慢
+        avif_quality (int, optional): avif 图片质量, 0-100
+        avif_speed (int, optional): avif 编码速度, 0-10, 越小图片越小但越慢
+        avif_threads (int, optional): avif 编码线程数, 0 为按 CPU 线程数自动选择
+        max_height (int, optional): 最大高度, 超出部分将被截断, 0 为不限制
+        page_height (int, optional): 分页高度, 按此高度将结果拆分为多张图片, 0 为不分页
+        draw_bands (int, optional): 并行绘制的水平分带数, 0 为按 CPU 线程数自动选择
+        stream_encode (bool, optional): 是否边绘制边编码图片, 启用时忽略 draw_bands
+        transparent_background (bool, optional): 是否保留透明背景, 不能与 jpeg 同时使用
+        grayscale (bool, optional): 是否输出 8 位灰度图, 仅支持 png 和 jpeg
+        auto_crop (bool, optional): 是否在编码前裁掉四周的空白画布, 即白色,
+            透明背景时为透明, 不能与 page_height 同时使用
+        auto_crop_padding (int, optional): 自动裁剪后在内容四周保留的边距
+        keep_recording (bool, optional): 是否保留绘制记录, 以便不重新排版即可再次栅格化
         lang (str, optional): 语言
         culture (str, optional): 文化
         img_fetch_fn (ImgFetchFn, optional): 图片获取函数
@@ -229,10 +408,10 @@ async def html_to_pic(
         urljoin_fn (Callable, optional): urljoin函数
 
     Returns:
-        bytes: 渲染后的图片字节
+        RenderResult: 渲染结果
     """
     loop = get_running_loop()
-    return await core._render_internal(  # pyright: ignore[reportPrivateUsage]
+    output = await core._render_internal(  # pyright: ignore[reportPrivateUsage]
         html,
         base_url,
         dpi,
@@ -244,9 +423,7 @@ async def html_to_pic(
         -1 if image_format == "png" else jpeg_quality,
         lang,
         culture,
-        lambda exc_type, exc_value, exc_traceback: nonebot.logger.opt(
-            exception=(exc_type, exc_value, exc_traceback)
-        ).error("Exception in html_to_pic: "),
+        _log_render_exception,
         run_coroutine_threadsafe,
         urljoin_fn,
         loop,
@@ -254,9 +431,182 @@ async def html_to_pic(
         css_fetch_fn,
         native_data_scheme,
         False,
+        {
+            "image_format": image_format,
+            "max_height": max_height,
+            "page_height": page_height,
+            "draw_bands": draw_bands,
+            "stream_encode": stream_encode,
+            "png_compression": png_compression,
+            "webp_quality": webp_quality,
+            "webp_lossless": webp_lossless,
+            "webp_method": webp_method,
+            "avif_quality": avif_quality,
+            "avif_speed": avif_speed,
+            "avif_threads": avif_threads,
+            "png_palette": png_palette,
+            "transparent_background": transparent_background,
+            "jpeg_subsampling": jpeg_subsampling,
+            "jpeg_fast_dct": jpeg_fast_dct,
+            "jpeg_optimize": jpeg_optimize,
+            "jpeg_progressive": jpeg_progressive,
+            "jpeg_restart_rows": jpeg_restart_rows,
+            "grayscale": grayscale,
+            "auto_crop": auto_crop,
+            "auto_crop_padding": auto_crop_padding,
+            "keep_recording": keep_recording,
+            "scale": scale,
+            "quality": quality,
+        },
+    )
+    pages = [_page_image(page) for page in output["pages"]]
+    recording = output.get("recording")
+    return RenderResult(
+        image=pages[0],
+        pages=pages,
+        truncated=output["truncated"],
+        culled_draws=output["culled_draws"],
+        recording=(
+            Recording(recording["handle"], recording["width"], recording["height"])
+            if recording is not None
+            else None
+        ),
     )
 
 
+async def html_to_pic(
+    html: str,
+    *,
+    base_url: str = "",
+    dpi: float = 96.0,
+    scale: float = 1.0,
+    quality: Literal["fast", "normal", "best"] = "normal",
+    max_width: float = 800.0,
+    device_height: float = 600.0,
+    default_font_size: float = 12.0,
+    font_name: str = "sans-serif",
+    allow_refit: bool = True,
+    image_format: Literal["png", "jpeg", "webp", "avif"] = "png",
+    jpeg_quality: int = 100,
+    jpeg_subsampling: Literal[444, 422, 420] = 420,
+    jpeg_fast_dct: bool = False,
+    jpeg_optimize: bool = False,
+    jpeg_progressive: bool = False,
+    jpeg_restart_rows: int = 0,
+    png_compression: int = 6,
+    png_palette: bool = False,
+    webp_quality: int = 80,
+    webp_lossless: bool = False,
+    webp_method: int = 4,
+    avif_quality: int = 60,
+    avif_speed: int = 6,
+    avif_threads: int = 1,
+    max_height: int = 0,
+    draw_bands: int = 1,
+    stream_encode: bool = False,
+    transparent_background: bool = False,
+    grayscale: bool = False,
+    auto_crop: bool = False,
+    auto_crop_padding: int = 0,
+    lang: str = "zh",
+    culture: str = "CN",
+    img_fetch_fn: ImgFetchFn = combined_img_fetcher,
+    css_fetch_fn: CSSFetchFn = combined_css_fetcher,
+    native_data_scheme: bool = True,
+    urljoin_fn: Callable[[str, str], str] = urljoin,
+) -> bytes:
+    """
+    将 HTML 渲染为图片。
+
+    Args:
+        html (str): HTML 内容
+        base_url (str, optional): 基础路径
+        dpi (float, optional): DPI
+        scale (float, optional): 像素密度倍数, 按原尺寸排版后以此倍数绘制, 不影响换行
+        quality ("fast" | "normal" | "best", optional): 绘制质量, "fast" 更快,
+            "best" 抗锯齿与图片缩放更精细, 字形按亚像素定位
+        max_width (float, optional): 最大宽度
+        device_height (float, optional): 设备高度
+        default_font_size (float, optional): 默认字体大小
+        font_name (str, optional): 字体名称
+        allow_refit (bool, optional): 允许根据内容缩小宽度
+        image_format ("png" | "jpeg" | "webp" | "avif", optional): 图片格式
+        jpeg_quality (int, optional): jpeg图片质量, 1-100
+        jpeg_subsampling (444 | 422 | 420, optional): 色度抽样, 444 更清晰, 420 更小
+        jpeg_fast_dct (bool, optional): jpeg 是否使用更快但略不精确的 DCT
+        jpeg_optimize (bool, optional): jpeg 是否优化 Huffman 表, 图片更小但更慢
+        jpeg_progressive (bool, optional): 是否输出渐进式 jpeg
+        jpeg_restart_rows (int, optional): jpeg 每隔多少行 MCU 插入重启标记, 0 为不插入
+        png_compression (int, optional): png 压缩等级, 0-9, 越大图片越小但越慢
+        png_palette (bool, optional): 是否输出 8 位调色板 png, 超过 256 色时会量化
+        webp_quality (int, optional): webp 图片质量, 1-100, 无损模式下为压缩力度
+        webp_lossless (bool, optional): 是否使用无损 webp
+        webp_method (int, optional): webp 压缩方法, 0-6, 越大图片越小但越慢
+        avif_quality (int, optional): avif 图片质量, 0-100
+        avif_speed (int, optional): avif 编码速度, 0-10, 越小图片越小但越慢
+        avif_threads (int, optional): avif 编码线程数, 0 为按 CPU 线程数自动选择
+        max_height (int, optional): 最大高度, 超出部分将被截断, 0 为不限制
+        draw_bands (int, optional): 并行绘制的水平分带数, 0 为按 CPU 线程数自动选择
+        stream_encode (bool, optional): 是否边绘制边编码图片, 启用时忽略 draw_bands
+        transparent_background (bool, optional): 是否保留透明背景, 不能与 jpeg 同时使用
+        grayscale (bool, optional): 是否输出 8 位灰度图, 仅支持 png 和 jpeg
+        auto_crop (bool, optional): 是否在编码前裁掉四周的空白画布, 即白色,
+            透明背景时为透明
+        auto_crop_padding (int, optional): 自动裁剪后在内容四周保留的边距
+        lang (str, optional): 语言
+        culture (str, optional): 文化
+        img_fetch_fn (ImgFetchFn, optional): 图片获取函数
+        css_fetch_fn (CSSFetchFn, optional): CSS获取函数
+        native_data_scheme (bool, optional): 是否使用原生代码解码 base64 data scheme URL
+        urljoin_fn (Callable, optional): urljoin函数
+
+    Returns:
+        bytes: 渲染后的图片字节
+    """
+    result = await render_html(
+        html,
+        base_url=base_url,
+        dpi=dpi,
+        scale=scale,
+        quality=quality,
+        max_width=max_width,
+        device_height=device_height,
+        default_font_size=default_font_size,
+        font_name=font_name,
+        allow_refit=allow_refit,
+        image_format=image_format,
+        jpeg_quality=jpeg_quality,
+        jpeg_subsampling=jpeg_subsampling,
+        jpeg_fast_dct=jpeg_fast_dct,
+        jpeg_optimize=jpeg_optimize,
+        jpeg_progressive=jpeg_progressive,
+        jpeg_restart_rows=jpeg_restart_rows,
+        png_compression=png_compression,
+        png_palette=png_palette,
+        webp_quality=webp_quality,
+        webp_lossless=webp_lossless,
+        webp_method=webp_method,
+        avif_quality=avif_quality,
+        avif_speed=avif_speed,
+        avif_threads=avif_threads,
+        max_height=max_height,
+        draw_bands=draw_bands,
+        stream_encode=stream_encode,
+        transparent_background=transparent_background,
+        grayscale=grayscale,
+        auto_crop=auto_crop,
+        auto_crop_padding=auto_crop_padding,
+        lang=lang,
+        culture=culture,
+        img_fetch_fn=img_fetch_fn,
+        css_fetch_fn=css_fetch_fn,
+        native_data_scheme=native_data_scheme,
+        urljoin_fn=urljoin_fn,
+    )
+    assert isinstance(result.image, bytes)
+    return result.image
+
+
 async def debug_html_to_pic(
     html: str,
     *,
@@ -301,7 +651,7 @@ async def debug_html_to_pic(
         tuple[bytes, str]: 渲染后的图片字节和调试用 HTML 字符串
     """
     loop = get_running_loop()
-    return await core._render_internal(  # pyright: ignore[reportPrivateUsage]
+    output = await core._render_internal(  # pyright: ignore[reportPrivateUsage]
         html,
         base_url,
         dpi,
@@ -313,9 +663,7 @@ async def debug_html_to_pic(
         -1 if image_format == "png" else jpeg_quality,
         lang,
         culture,
-        lambda exc_type, exc, tb: nonebot.logger.opt(
-            exception=(exc_type, exc, tb)
-        ).error("Exception in html_to_pic: "),
+        _log_render_exception,
         run_coroutine_threadsafe,
         urljoin_fn,
         loop,
@@ -323,7 +671,9 @@ async def debug_html_to_pic(
         css_fetch_fn,
         native_data_scheme,
         True,
+        {},
     )
+    return output["image"], output["debug_html"]
 
 
 TEMPLATES_PATH = str(Path(__file__).parent / "templates")
@@ -341,8 +691,9 @@ async def text_to_pic(
     *,
     max_width: int = 500,
     allow_refit: bool = True,
-    image_format: Literal["png", "jpeg"] = "png",
+    image_format: Literal["png", "jpeg", "webp", "avif"] = "png",
     jpeg_quality: int = 100,
+    max_height: int = 0,
 ) -> bytes:
     """
     多行文本转图片
@@ -352,8 +703,9 @@ async def text_to_pic(
         css_path (str, optional): css文件路径
         max_width (int, optional): 图片最大宽度，默认为 500
         allow_refit (bool, optional): 允许根据内容缩小宽度，默认为 True
-        image_format ("png" | "jpeg", optional): 图片格式, 默认为 "png"
+        image_format ("png" | "jpeg" | "webp" | "avif", optional): 图片格式, 默认 "png"
         jpeg_quality (int, optional): jpeg图片质量, 1-100, 默认为 100
+        max_height (int, optional): 最大高度, 超出部分将被截断, 默认为 0 即不限制
 
     Returns:
         bytes: 图片, 可直接发送
@@ -369,6 +721,7 @@ async def text_to_pic(
         allow_refit=allow_refit,
         image_format=image_format,
         jpeg_quality=jpeg_quality,
+        max_height=max_height,
     )
 
 
@@ -380,8 +733,9 @@ async def md_to_pic(
     max_width: int = 500,
     img_fetch_fn: ImgFetchFn = combined_img_fetcher,
     allow_refit: bool = True,
-    image_format: Literal["png", "jpeg"] = "png",
+    image_format: Literal["png", "jpeg", "webp", "avif"] = "png",
     jpeg_quality: int = 100,
+    max_height: int = 0,
 ) -> bytes:
     """
     markdown 转 图片
@@ -393,8 +747,9 @@ async def md_to_pic(
         max_width (int, optional): 图片最大宽度，默认为 500
         img_fetch_fn (ImgFetchFn, optional): 图片获取函数，默认为 combined_img_fetcher
         allow_refit (bool, optional): 允许根据内容缩小宽度，默认为 True
-        image_format ("png" | "jpeg", optional): 图片格式, 默认为 "png"
+        image_format ("png" | "jpeg" | "webp" | "avif", optional): 图片格式, 默认 "png"
         jpeg_quality (int, optional): jpeg图片质量, 1-100, 默认为 100
+        max_height (int, optional): 最大高度, 超出部分将被截断, 默认为 0 即不限制
 
     Returns:
         bytes: 图片, 可直接发送
@@ -438,6 +793,7 @@ async def md_to_pic(
         allow_refit=allow_refit,
         image_format=image_format,
         jpeg_quality=jpeg_quality,
+        max_height=max_height,
     )
 
 
@@ -484,8 +840,9 @@ async def template_to_pic(
     img_fetch_fn: ImgFetchFn = combined_img_fetcher,
     css_fetch_fn: CSSFetchFn = combined_css_fetcher,
     allow_refit: bool = True,
-    image_format: Literal["png", "jpeg"] = "png",
+    image_format: Literal["png", "jpeg", "webp", "avif"] = "png",
     jpeg_quality: int = 100,
+    max_height: int = 0,
 ) -> bytes:
     """
     使用jinja2模板引擎通过html生成图片
@@ -502,8 +859,9 @@ async def template_to_pic(
         img_fetch_fn (ImgFetchFn, optional): 图片获取函数
         css_fetch_fn (CSSFetchFn, optional): css获取函数
         allow_refit (bool, optional): 允许根据内容缩小宽度
-        image_format ("png" | "jpeg", optional): 图片格式, 默认为 "png"
+        image_format ("png" | "jpeg" | "webp" | "avif", optional): 图片格式, 默认 "png"
         jpeg_quality (int, optional): jpeg图片质量, 1-100, 默认为 100
+        max_height (int, optional): 最大高度, 超出部分将被截断, 默认为 0 即不限制
 
     Returns:
         bytes: 图片 可直接发送
@@ -533,4 +891,5 @@ async def template_to_pic(
         allow_refit=allow_refit,
         image_format=image_format,
         jpeg_quality=jpeg_quality,
+        max_height=max_height,
     )
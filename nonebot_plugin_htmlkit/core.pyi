@@ -2,8 +2,8 @@ import asyncio
 from collections.abc import Callable, Coroutine
 import concurrent.futures
 from types import TracebackType
-from typing import Any, Literal, TypeAlias, overload
-from typing_extensions import Unpack
+from typing import Any, Literal, TypeAlias, TypedDict
+from typing_extensions import NotRequired, Unpack
 
 def _init_fontconfig_internal() -> None: ...
 
@@ -17,30 +17,54 @@ _UrlJoinFn: TypeAlias = Callable[[str, str], str]
 _ImageFetchFn: TypeAlias = Callable[[str], Coroutine[Any, Any, None | bytes]]
 _CSSFetchFn: TypeAlias = Callable[[str], Coroutine[Any, Any, None | str]]
 
-@overload
-def _render_internal(
-    html_content: str,
-    base_url: str,
-    dpi: float,
-    width: float,
-    height: float,
-    default_font_size: float,
-    font_name: str,
-    allow_refit: bool,
-    image_flag: int,
-    lang: str,
-    culture: str,
-    exception_fn: _ExceptionHandleFn,
-    asyncio_run_coroutine_threadsafe: _AsyncioRunCoroutineThreadsafeFn,
-    urljoin: _UrlJoinFn,
-    loop: asyncio.AbstractEventLoop,
-    img_fetch_fn: _ImageFetchFn,
-    css_fetch_fn: _CSSFetchFn,
-    native_data_scheme: bool,
-    debug_flag: Literal[False],
-    /,
-) -> asyncio.Future[bytes]: ...
-@overload
+class _RenderOptions(TypedDict, total=False):
+    max_height: int
+    page_height: int
+    draw_bands: int
+    stream_encode: bool
+    transparent_background: bool
+    image_format: Literal["png", "jpeg", "webp", "avif", "raw"]
+    grayscale: bool
+    auto_crop: bool
+    auto_crop_padding: int
+    keep_recording: bool
+    scale: float
+    quality: Literal["fast", "normal", "best"]
+    png_compression: int
+    png_palette: bool
+    jpeg_subsampling: Literal[444, 422, 420]
+    jpeg_fast_dct: bool
+    jpeg_optimize: bool
+    jpeg_progressive: bool
+    jpeg_restart_rows: int
+    webp_quality: int
+    webp_lossless: bool
+    webp_method: int
+    avif_quality: int
+    avif_speed: int
+    avif_threads: int
+
+class _RawPage(TypedDict):
+    data: bytearray
+    width: int
+    height: int
+    stride: int
+    format: Literal["ARGB32", "RGB24"]
+
+class _Recording(TypedDict):
+    handle: object
+    width: int
+    height: int
+
+class _RenderOutput(TypedDict):
+    image: bytes | _RawPage
+    pages: list[bytes | _RawPage]
+    truncated: bool
+    # Summed over every pass over the document, one per page, band and stream band
+    culled_draws: int
+    recording: NotRequired[_Recording]
+    debug_html: NotRequired[str]
+
 def _render_internal(
     html_content: str,
     base_url: str,
@@ -60,28 +84,19 @@ def _render_internal(
     img_fetch_fn: _ImageFetchFn,
     css_fetch_fn: _CSSFetchFn,
     native_data_scheme: bool,
-    debug_flag: Literal[True],
+    debug_flag: bool,
+    options: _RenderOptions,
     /,
-) -> asyncio.Future[tuple[bytes, str]]: ...
-def _render_internal(
-    html_content: str,
-    base_url: str,
-    dpi: float,
+) -> asyncio.Future[_RenderOutput]: ...
+
+def _rasterize_internal(
+    recording: object,
+    scale: float,
+    x: float,
+    y: float,
     width: float,
     height: float,
-    default_font_size: float,
-    font_name: str,
-    allow_refit: bool,
-    image_flag: int,
-    lang: str,
-    culture: str,
-    exception_fn: _ExceptionHandleFn,
-    asyncio_run_coroutine_threadsafe: _AsyncioRunCoroutineThreadsafeFn,
-    urljoin: _UrlJoinFn,
-    loop: asyncio.AbstractEventLoop,
-    img_fetch_fn: _ImageFetchFn,
-    css_fetch_fn: _CSSFetchFn,
-    native_data_scheme: bool,
-    debug_flag: bool,
+    jpeg_quality: int,
+    options: _RenderOptions,
     /,
-) -> asyncio.Future[bytes | tuple[bytes, str]]: ...
+) -> bytes: ...
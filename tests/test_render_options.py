@@ -0,0 +1,378 @@
+import asyncio
+import base64
+from io import BytesIO
+import sys
+
+from PIL import Image
+import pytest
+from utils import load_image_bytes, mse, open_image, render_image
+
+
+@pytest.mark.asyncio
+async def test_render_concurrent_identical():
+    from nonebot_plugin_htmlkit import html_to_pic
+
+    calls = 0
+    submitted = asyncio.Event()
+
+    async def counting_fetcher(_url: str) -> None:
+        nonlocal calls
+        calls += 1
+        # Hold the render until every request has joined it
+        await submitted.wait()
+
+    html = (
+        "<html><body><h1>Hello, World!</h1><p>Concurrent test.</p>"
+        '<img src="counted://image.png"></body></html>'
+    )
+    tasks = [
+        asyncio.create_task(html_to_pic(html, img_fetch_fn=counting_fetcher))
+        for _ in range(8)
+    ]
+    # Each task joins the flight before its first suspension
+    await asyncio.sleep(0)
+    submitted.set()
+    results = await asyncio.gather(*tasks)
+    assert all(img_bytes == results[0] for img_bytes in results)
+    assert results[0].startswith(b"\x89PNG\r\n\x1a\n")
+    # Identical requests in flight share one render, so the image is fetched once
+    assert calls == 1
+
+
+@pytest.mark.asyncio
+async def test_render_max_height():
+    from nonebot_plugin_htmlkit import render_html
+
+    html = "<html><body>" + "<p>Line</p>" * 200 + "</body></html>"
+    result = await render_html(html, max_height=100)
+    assert result.truncated
+    assert open_image(result.image).height == 100
+
+    result = await render_html(html, max_height=100000)
+    assert not result.truncated
+
+    # Values past int range are rejected rather than wrapped into range
+    with pytest.raises(OverflowError, match="max_height"):
+        await render_html(html, max_height=2**32 + 10)
+
+
+@pytest.mark.asyncio
+async def test_render_pages():
+    from nonebot_plugin_htmlkit import render_html
+
+    html = "<html><body>" + "<p>Line</p>" * 200 + "</body></html>"
+    full = await render_html(html)
+    height = open_image(full.image).height
+
+    result = await render_html(html, page_height=256)
+    assert len(result.pages) == (height + 255) // 256
+    assert result.image == result.pages[0]
+    heights = [open_image(page).height for page in result.pages]
+    assert all(page_height == 256 for page_height in heights[:-1])
+    assert sum(heights) == height
+
+
+@pytest.mark.asyncio
+async def test_render_draw_bands():
+    from nonebot_plugin_htmlkit import html_to_pic
+
+    paragraph = "<p><b>Bold</b> and <i>italic</i></p>"
+    html = "<html><body>" + paragraph * 100 + "</body></html>"
+    serial = await html_to_pic(html)
+    banded = await html_to_pic(html, draw_bands=4)
+    assert mse(load_image_bytes(serial), load_image_bytes(banded)) < 1.0
+
+
+@pytest.mark.asyncio
+async def test_render_stream_encode():
+    from nonebot_plugin_htmlkit import html_to_pic
+
+    paragraph = "<p><b>Bold</b> and <i>italic</i></p>"
+    html = "<html><body>" + paragraph * 100 + "</body></html>"
+    for image_format in ("png", "jpeg"):
+        serial = await html_to_pic(html, image_format=image_format)
+        streamed = await html_to_pic(
+            html, image_format=image_format, stream_encode=True
+        )
+        assert mse(load_image_bytes(serial), load_image_bytes(streamed)) < 1.0
+
+
+@pytest.mark.asyncio
+async def test_render_png_compression():
+    from nonebot_plugin_htmlkit import html_to_pic
+
+    html = "<html><body>" + "<p>Compression</p>" * 50 + "</body></html>"
+    stored = await html_to_pic(html, png_compression=0)
+    smallest = await html_to_pic(html, png_compression=9)
+    assert len(smallest) < len(stored)
+    assert mse(load_image_bytes(stored), load_image_bytes(smallest)) == 0
+
+
+@pytest.mark.asyncio
+async def test_render_webp():
+    from nonebot_plugin_htmlkit import html_to_pic
+
+    html = "<html><body>" + "<p>WebP</p>" * 50 + "</body></html>"
+    png = await html_to_pic(html)
+    lossless = await html_to_pic(html, image_format="webp", webp_lossless=True)
+    lossy = await html_to_pic(html, image_format="webp", webp_quality=50)
+    assert open_image(lossless).format == "WEBP"
+    assert mse(load_image_bytes(png), load_image_bytes(lossless)) == 0
+    assert mse(load_image_bytes(png), load_image_bytes(lossy)) < 100.0
+
+
+@pytest.mark.asyncio
+async def test_render_avif():
+    from nonebot_plugin_htmlkit import html_to_pic
+
+    html = "<html><body>" + "<p>AVIF</p>" * 50 + "</body></html>"
+    png = await html_to_pic(html)
+    avif = await html_to_pic(html, image_format="avif", avif_quality=90, avif_speed=10)
+    assert avif[4:12] == b"ftypavif"
+    assert len(avif) < len(png)
+
+
+@pytest.mark.asyncio
+async def test_render_png_palette():
+    from nonebot_plugin_htmlkit import html_to_pic
+
+    html = "<html><body>" + "<p>Palette</p>" * 50 + "</body></html>"
+    truecolor = await html_to_pic(html)
+    palette = await html_to_pic(html, png_palette=True)
+    assert open_image(palette).mode == "P"
+    assert len(palette) < len(truecolor)
+    assert mse(load_image_bytes(truecolor), load_image_bytes(palette)) < 1.0
+
+
+@pytest.mark.asyncio
+async def test_render_transparent_background():
+    from nonebot_plugin_htmlkit import html_to_pic
+
+    html = "<html><body><p>Transparent</p></body></html>"
+    opaque = await render_image(html)
+    assert opaque.mode == "RGB"
+    transparent = await render_image(html, transparent_background=True)
+    assert transparent.mode == "RGBA"
+    assert transparent.getpixel((0, 0))[3] == 0
+    with pytest.raises(ValueError, match="transparent"):
+        await html_to_pic(html, transparent_background=True, image_format="jpeg")
+
+
+@pytest.mark.asyncio
+async def test_render_jpeg_options():
+    from nonebot_plugin_htmlkit import html_to_pic
+
+    html = "<html><body>" + "<p>JPEG</p>" * 50 + "</body></html>"
+    baseline = await html_to_pic(html, image_format="jpeg", jpeg_quality=90)
+    archive = await html_to_pic(
+        html,
+        image_format="jpeg",
+        jpeg_quality=90,
+        jpeg_optimize=True,
+        jpeg_progressive=True,
+    )
+    preview = await html_to_pic(
+        html,
+        image_format="jpeg",
+        jpeg_quality=90,
+        jpeg_subsampling=444,
+        jpeg_fast_dct=True,
+        jpeg_restart_rows=4,
+    )
+    assert len(archive) < len(baseline)
+    assert open_image(archive).info.get("progressive")
+    for image in (archive, preview):
+        assert mse(load_image_bytes(baseline), load_image_bytes(image)) < 10.0
+
+
+@pytest.mark.asyncio
+async def test_render_raw():
+    from nonebot_plugin_htmlkit import RawImage, render_html
+
+    html = "<html><body><p>Raw pixels</p></body></html>"
+    result = await render_html(html, image_format="raw")
+    raw = result.image
+    assert isinstance(raw, RawImage)
+    assert raw.format == "RGB24"
+    assert raw.stride >= raw.width * 4
+    assert len(memoryview(raw.data)) == raw.stride * raw.height
+    if sys.version_info >= (3, 12):
+        view = memoryview(raw)
+        assert len(view) == raw.stride * raw.height
+        # A view, not a copy, of the pixels
+        view[0] ^= 0xFF
+        assert raw.data[0] == view[0]
+        view[0] ^= 0xFF
+    else:
+        with pytest.raises(TypeError):
+            memoryview(raw)  # pyright: ignore[reportArgumentType]
+    decoded = Image.frombuffer(
+        "RGB", (raw.width, raw.height), raw.data, "raw", "BGRX", raw.stride
+    )
+    png = (await render_image(html)).convert("RGB")
+    assert decoded.size == png.size
+    assert decoded.tobytes() == png.tobytes()
+
+
+@pytest.mark.asyncio
+async def test_render_grayscale():
+    from nonebot_plugin_htmlkit import html_to_pic
+
+    html = '<html><body><p style="color: #c33">Grayscale</p></body></html>'
+    color = (await render_image(html)).convert("L")
+    gray = await render_image(html, grayscale=True)
+    assert gray.mode == "L"
+    assert gray.size == color.size
+    assert max(abs(a - b) for a, b in zip(gray.tobytes(), color.tobytes())) <= 1
+    gray_jpeg = await html_to_pic(html, image_format="jpeg", grayscale=True)
+    assert open_image(gray_jpeg).mode == "L"
+    with pytest.raises(ValueError):
+        await html_to_pic(html, image_format="webp", grayscale=True)
+
+
+@pytest.mark.asyncio
+async def test_render_auto_crop():
+    from nonebot_plugin_htmlkit import render_html
+
+    html = (
+        '<html><body style="margin: 40px">'
+        '<div style="width: 50px; height: 30px; background: #000"></div>'
+        '<div style="height: 200px"></div></body></html>'
+    )
+    full = await render_image(html, allow_refit=False)
+    cropped = await render_image(html, allow_refit=False, auto_crop=True)
+    assert cropped.size == (50, 30)
+    assert full.size[0] > 50 and full.size[1] > 200
+    padded = await render_image(
+        html, allow_refit=False, auto_crop=True, auto_crop_padding=5
+    )
+    assert padded.size == (60, 40)
+    # Content in the bottom left corner is not mistaken for the background
+    footer = (
+        '<html><body style="margin: 0">'
+        '<div style="margin: 40px; width: 50px; height: 30px; background: #000">'
+        '</div><div style="width: 20px; height: 20px; background: #00f"></div>'
+        "</body></html>"
+    )
+    cropped = await render_image(footer, allow_refit=False, auto_crop=True)
+    assert cropped.size == (90, 90)
+    with pytest.raises(ValueError, match="page_height"):
+        await render_html(html, auto_crop=True, page_height=100)
+
+
+@pytest.mark.asyncio
+async def test_render_repeated_gradient():
+    html = (
+        '<html><body style="margin: 0"><div style="width: 200px; height: 100px; '
+        "background-image: linear-gradient(to right, #f00, #00f); "
+        'background-size: 20px 20px"></div></body></html>'
+    )
+    image = await render_image(html, allow_refit=False)
+    image = image.convert("RGB")
+    for x, y in ((3, 5), (11, 17), (18, 2)):
+        tile = image.getpixel((x, y))
+        assert tile != image.getpixel((x + 1, y))
+        for dx, dy in ((20, 0), (100, 40), (160, 80)):
+            assert image.getpixel((x + dx, y + dy)) == tile
+
+
+@pytest.mark.asyncio
+async def test_render_culled_draws():
+    from nonebot_plugin_htmlkit import render_html
+
+    html = (
+        '<html><body><div style="height: 40px; overflow: hidden">'
+        + "<p>Hidden line</p>" * 50
+        + "</div></body></html>"
+    )
+    result = await render_html(html)
+    assert result.culled_draws > 0
+    visible = await render_html("<html><body><p>Visible</p></body></html>")
+    assert visible.culled_draws == 0
+
+
+@pytest.mark.asyncio
+async def test_render_keep_recording():
+    from nonebot_plugin_htmlkit import render_html
+
+    html = "<html><body><h1>Recorded</h1>" + "<p>Line</p>" * 20 + "</body></html>"
+    result = await render_html(html, keep_recording=True)
+    assert isinstance(result.image, bytes)
+    assert result.recording is not None
+    page = open_image(result.image)
+    replay = await result.recording.rasterize()
+    assert open_image(replay).size == page.size
+    assert mse(load_image_bytes(replay), load_image_bytes(result.image)) < 1
+    half = open_image(await result.recording.rasterize(scale=0.5))
+    assert half.size == ((page.width + 1) // 2, (page.height + 1) // 2)
+    crop = await result.recording.rasterize(
+        scale=2.0, crop=(0, 0, 100, 50), image_format="jpeg"
+    )
+    assert open_image(crop).size == (200, 100)
+    assert (await render_html(html)).recording is None
+
+
+@pytest.mark.asyncio
+async def test_render_device_scale():
+    from nonebot_plugin_htmlkit import html_to_pic, render_html
+
+    html = "<html><body><p>" + "Scaled text wraps the same way. " * 20
+    html += "</p></body></html>"
+    single = await render_image(html)
+    double = await render_image(html, scale=2.0)
+    assert double.size == (single.width * 2, single.height * 2)
+    result = await render_html(html, scale=2.0, keep_recording=True)
+    assert result.recording is not None
+    assert result.recording.width == single.width
+    one_x = await result.recording.rasterize()
+    assert open_image(one_x).size == single.size
+    with pytest.raises(ValueError, match="scale"):
+        await html_to_pic(html, scale=0)
+
+
+@pytest.mark.asyncio
+async def test_render_quality():
+    from nonebot_plugin_htmlkit import html_to_pic
+
+    # A 2x2 checkerboard blown up to 64x64, nearest and smooth filtering differ
+    checker = Image.new("RGB", (2, 2), "white")
+    checker.putpixel((0, 0), (0, 0, 0))
+    checker.putpixel((1, 1), (0, 0, 0))
+    buffer = BytesIO()
+    checker.save(buffer, format="PNG")
+    src = "data:image/png;base64," + base64.b64encode(buffer.getvalue()).decode()
+    html = (
+        '<html><body><p style="border-radius: 8px; border: 2px solid red">'
+        + "Quality preset. " * 10
+        + f'</p><img src="{src}" width="64" height="64"></body></html>'
+    )
+    images = {}
+    for quality in ("fast", "normal", "best"):
+        img_bytes = await html_to_pic(html, quality=quality)
+        assert img_bytes.startswith(b"\x89PNG\r\n\x1a\n")
+        images[quality] = img_bytes
+    fast = load_image_bytes(images["fast"])
+    best = load_image_bytes(images["best"])
+    assert fast.shape != best.shape or mse(fast, best) > 0
+    with pytest.raises(ValueError, match="quality"):
+        await html_to_pic(html, quality="ultra")  # pyright: ignore[reportArgumentType]
+
+
+@pytest.mark.asyncio
+async def test_render_rounded_clip_and_border():
+    html = (
+        '<html><body style="margin: 0">'
+        '<div style="margin: 20px; width: 100px; height: 60px; overflow: hidden; '
+        'border: 4px solid #00f; border-radius: 30px / 10px">'
+        '<div style="height: 60px; background: #f00"></div></div></body></html>'
+    )
+    img = await render_image(html, allow_refit=False)
+    img = img.convert("RGB")
+    # Outside the elliptic corners, top left and bottom right
+    assert img.getpixel((21, 21)) == (255, 255, 255)
+    assert img.getpixel((126, 86)) == (255, 255, 255)
+    # Left of the box along the bottom edge
+    assert img.getpixel((15, 86)) == (255, 255, 255)
+    # Border on the straight left edge, clipped content in the middle
+    assert img.getpixel((21, 54)) == (0, 0, 255)
+    assert img.getpixel((74, 54)) == (255, 0, 0)
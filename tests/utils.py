@@ -15,6 +15,16 @@ def mse(img1, img2):
     return np.mean((img1 - img2) ** 2)
 
 
+def open_image(img_bytes):
+    return Image.open(BytesIO(img_bytes))
+
+
+async def render_image(html, **kwargs):
+    from nonebot_plugin_htmlkit import html_to_pic
+
+    return open_image(await html_to_pic(html, **kwargs))
+
+
 REF_PATH = Path(__file__).parent / "ref_images"
 REF_PATH.mkdir(exist_ok=True, parents=True)
 
@@ -20,7 +20,7 @@ set_license("LGPL-3.0-or-later")
 
 add_repositories("my-repo repo")
 
-add_requires("litehtml", "pango", "libjpeg-turbo", "libwebp", "giflib", "aklomp-base64", "fmt")
+add_requires("litehtml", "pango", "libjpeg-turbo", "libwebp", "giflib", "aklomp-base64", "fmt", "zlib")
 set_languages("c++17")
 add_requires("libavif", {configs = { aom = true }})
 add_requires("cairo", {configs = { xlib = false }})
@@ -37,7 +37,7 @@ function require_htmlkit()
             add_linkorders("pangocairo-1.0", "pangoft2-1.0", "pango-1.0")
         end
     end
-    add_packages("litehtml", "cairo", "pango", "libjpeg-turbo", "libwebp", "libavif", "giflib", "aklomp-base64", "fmt")
+    add_packages("litehtml", "cairo", "pango", "libjpeg-turbo", "libwebp", "libavif", "giflib", "aklomp-base64", "fmt", "zlib")
     add_packages("python", { links = {} })
     add_files("core/*.cpp")
     add_defines("UNICODE", "PY_SSIZE_T_CLEAN")